@@ -16,10 +16,13 @@ print_name(struct name *np)
 static void
 print_prerequisites(struct rule *rp)
 {
-	struct depend *dp;
+	uint32_t i;
 
-	for (dp = rp->r_dep; dp; dp = dp->d_next)
-		printf(" %s", dp->d_name->n_name);
+	for (i = 0; i < rp->r_ndep; i++) {
+		if (i == normaldeps(rp))
+			printf(" |");
+		printf(" %s", getdep(rp, i)->n_name);
+	}
 }
 
 static void
@@ -34,18 +37,21 @@ print_commands(struct rule *rp)
 void
 print_details(void)
 {
-	int i;
+	unsigned int i;
 	struct macro *mp;
 	struct name *np;
 	struct rule *rp;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct prule *pr;
+#endif
 
-	for (i = 0; i < HTABSIZE; i++)
-		for (mp = macrohead[i]; mp; mp = mp->m_next)
+	for (i = 0; i < macrotab.h_size; i++)
+		if ((mp = macrotab.h_slot[i].h_data))
 			printf("%s = %s\n", mp->m_name, mp->m_val);
 	putchar('\n');
 
-	for (i = 0; i < HTABSIZE; i++) {
-		for (np = namehead[i]; np; np = np->n_next) {
+	for (i = 0; i < nametab.h_size; i++) {
+		if ((np = nametab.h_slot[i].h_data)) {
 			if (!(np->n_flag & N_DOUBLE)) {
 				print_name(np);
 				for (rp = np->n_rule; rp; rp = rp->r_next) {
@@ -69,4 +75,17 @@ print_details(void)
 			}
 		}
 	}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	for (pr = prules; pr; pr = pr->pr_next) {
+		if (pr->pr_rule.r_cmd) {
+			printf("%s:", pr->pr_target);
+			print_prerequisites(&pr->pr_rule);
+			putchar('\n');
+
+			print_commands(&pr->pr_rule);
+			putchar('\n');
+		}
+	}
+#endif
 }
@@ -0,0 +1,420 @@
+/*
+ * Dependencies found while making targets
+ */
+#include "make.h"
+#include <poll.h>
+#include <sys/wait.h>
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// The prerequisites found when targets were last made, kept in a file
+// between runs.  Entries map a target name to a buffer holding a
+// space-separated list of escaped prerequisites.
+static struct htab deptab;
+static char *depdb;			// Name of file
+static bool depchanged;		// Table needs to be written
+
+#ifndef TRACELIB
+# define TRACELIB "/usr/local/lib/tracedeps.so"
+#endif
+
+// Files found for the target being made, in the order found, and a
+// table mapping their names to their index plus one.
+struct found {
+	char *f_name;
+	bool f_written;		// Written by a command, so not a prerequisite
+};
+static struct found *found;
+static size_t nfound, maxfound;
+static struct htab foundtab;
+static bool captured;		// Commands have been run
+static bool showinc;		// Look for included files in output
+static bool tracing;		// Trace files opened by commands
+
+/*
+ * Add a name to a list, escaped as in a dependency file.
+ */
+static void
+addescaped(struct buffer *bp, const char *s)
+{
+	if (bp->b_len)
+		bufadd(bp, " ", 1);
+	for (; *s; s++) {
+		if (*s == ' ' || *s == '#')
+			bufadd(bp, "\\", 1);
+		else if (*s == '$')
+			bufadd(bp, "$", 1);
+		bufadd(bp, s, 1);
+	}
+}
+
+/*
+ * Set the entry for a target in the table.
+ */
+static void
+setentry(const char *name, const char *deps)
+{
+	struct buffer *bp = hfind(&deptab, name);
+
+	if (bp == NULL) {
+		bp = xmalloc(sizeof(*bp));
+		*bp = (struct buffer){NULL, 0, 0};
+		hinsert(&deptab, xstrdup(name), bp);
+	}
+	bp->b_len = 0;
+	bufadd(bp, deps, strlen(deps));
+}
+
+/*
+ * Record a rule read from the dependency file.  Its prerequisites are
+ * marked so they're not an error if they no longer exist.
+ */
+void
+dbrule(struct name *np, uint32_t dep, uint32_t ndep)
+{
+	struct buffer buf = {NULL, 0, 0};
+	struct name *dp;
+	uint32_t i;
+
+	for (i = dep; i < dep + ndep; i++) {
+		dp = namev[edges[i]];
+		addescaped(&buf, dp->n_name);
+		dp->n_flag |= N_RECORDED;
+	}
+	setentry(np->n_name, buf.b_str ? buf.b_str : "");
+	free(buf.b_str);
+}
+
+/*
+ * Write the dependency file if it has changed and free the table.
+ */
+static void
+savedeps(void)
+{
+	unsigned int i;
+	struct buffer buf = {NULL, 0, 0}, *bp;
+	char *tmp;
+	FILE *fd;
+
+	if (depchanged) {
+		tmp = xconcat3(depdb, ".tmp", "");
+		if ((fd = fopen(tmp, "w")) != NULL) {
+			for (i = 0; i < deptab.h_size; i++) {
+				if (deptab.h_slot[i].h_data) {
+					buf.b_len = 0;
+					addescaped(&buf, deptab.h_slot[i].h_key);
+					fprintf(fd, "%s: %s\n", buf.b_str,
+							((struct buffer *)deptab.h_slot[i].h_data)->b_str);
+				}
+			}
+			if (fclose(fd) != 0 || rename(tmp, depdb) != 0)
+				unlink(tmp);
+		}
+		free(tmp);
+		free(buf.b_str);
+	}
+
+	for (i = 0; i < deptab.h_size; i++) {
+		if ((bp = deptab.h_slot[i].h_data)) {
+			free((char *)deptab.h_slot[i].h_key);
+			free(bp->b_str);
+			free(bp);
+		}
+	}
+	free(deptab.h_slot);
+	free(depdb);
+	free(found);
+}
+
+/*
+ * If dependencies are to be found while making targets, read the
+ * file of those found by previous runs.  It's written back when make
+ * exits.
+ */
+void
+loaddeps(void)
+{
+	if (posix || (!(opts & (OPT_showinc | OPT_trace)) &&
+			!findname(".SHOWINCLUDES") && !findname(".TRACEDEPS")))
+		return;
+
+	depdb = expand_macros("$(DEPDB)", FALSE);
+	if (*depdb == '\0') {
+		free(depdb);
+		depdb = xstrdup(".depdb");
+	}
+	readdeps(depdb, TRUE);
+	atexit(savedeps);
+}
+
+/*
+ * Start looking for the prerequisites of a target.  Return TRUE if
+ * its commands need to be run by capture().
+ */
+int
+startdeps(struct name *np)
+{
+	if (posix)
+		return FALSE;
+	showinc = (opts & OPT_showinc) || (np->n_flag & N_SHOWINC);
+	tracing = (opts & OPT_trace) || (np->n_flag & N_TRACE);
+	captured = FALSE;
+	return showinc || tracing;
+}
+
+/*
+ * Note a file used by a command.  Files which are written aren't
+ * prerequisites, even if they're also read.
+ */
+static void
+addfound(const char *name, bool written)
+{
+	uintptr_t i = (uintptr_t)hfind(&foundtab, name);
+
+	if (i == 0) {
+		if (nfound == maxfound) {
+			maxfound = MAX(2 * maxfound, 64);
+			found = xrealloc(found, maxfound * sizeof(*found));
+		}
+		found[nfound].f_name = xstrdup(name);
+		found[nfound].f_written = written;
+		hinsert(&foundtab, found[nfound].f_name, (void *)(nfound + 1));
+		nfound++;
+	} else if (written) {
+		found[i - 1].f_written = TRUE;
+	}
+}
+
+/*
+ * Process a line of output from a command.  Return TRUE if it's to
+ * be shown.
+ */
+static int
+outline(char *line, const char *prefix)
+{
+	size_t len = strlen(prefix);
+	char *s, *t;
+
+	if (strncmp(line, prefix, len) != 0)
+		return TRUE;
+	for (s = line + len; isblank(*s); s++)
+		;
+	for (t = s + strlen(s); t > s && isspace(t[-1]); t--)
+		;
+	*t = '\0';
+	if (*s)
+		addfound(s, FALSE);
+	return FALSE;
+}
+
+/*
+ * Process a line from the tracing library, which is 'r' or 'w' and
+ * an absolute path.  Paths below the current directory are made
+ * relative.
+ */
+static void
+traceline(char *line, const char *cwd)
+{
+	size_t len = strlen(cwd);
+	char *s = line + 2;
+
+	if (line[0] == '\0' || line[1] != ' ' || *s != '/')
+		return;
+	if (strncmp(s, "/proc/", 6) == 0 || strncmp(s, "/dev/", 5) == 0 ||
+			strncmp(s, "/sys/", 5) == 0)
+		return;
+	if (strncmp(s, cwd, len) == 0 && s[len] == '/')
+		s += len + 1;
+	addfound(s, line[0] == 'w');
+}
+
+/*
+ * Process the complete lines read from a command, leaving any partial
+ * line in the buffer.
+ */
+static void
+lines(struct buffer *bp, int kind, const char *prefix, const char *cwd)
+{
+	char *s = bp->b_str, *t;
+
+	while ((t = memchr(s, '\n', bp->b_str + bp->b_len - s))) {
+		*t = '\0';
+		if (kind == 't')
+			traceline(s, cwd);
+		else if (outline(s, prefix))
+			printf("%s\n", s);
+		s = t + 1;
+	}
+	bp->b_len -= s - bp->b_str;
+	memmove(bp->b_str, s, bp->b_len);
+}
+
+/*
+ * Run a command using the shell, as system(3) does, and return its
+ * status.  The files named in lines of its standard output starting
+ * with SHOWINCLUDES_PREFIX and those reported by the tracing library
+ * are noted.
+ */
+int
+capture(const char *cmd)
+{
+	struct pollfd pfd[2];
+	struct buffer buf[2] = {{NULL, 0, 0}, {NULL, 0, 0}};
+	int outfd[2] = {-1, -1}, tracefd[2] = {-1, -1};
+	char *prefix = NULL, *lib = NULL, *s, *t, cwd[PATH_MAX], tmp[BUFSIZ];
+	struct sigaction ign, oldint, oldquit;
+	int i, status = -1, npfd, nopen, ready;
+	bool exited;
+	char kind[2];
+	ssize_t n;
+	pid_t pid;
+
+	if (showinc) {
+		prefix = expand_macros("$(SHOWINCLUDES_PREFIX)", FALSE);
+		if (*prefix == '\0') {
+			free(prefix);
+			prefix = xstrdup("Note: including file:");
+		}
+		if (pipe(outfd) < 0)
+			goto done;
+	}
+	if (tracing) {
+		lib = expand_macros("$(TRACELIB)", FALSE);
+		if (*lib == '\0') {
+			free(lib);
+			lib = xstrdup(TRACELIB);
+		}
+		if (getcwd(cwd, sizeof(cwd)) == NULL || pipe(tracefd) < 0)
+			goto done;
+	}
+
+	// Ignore interrupts while the command runs, like system(3)
+	ign.sa_handler = SIG_IGN;
+	ign.sa_flags = 0;
+	sigemptyset(&ign.sa_mask);
+	sigaction(SIGINT, &ign, &oldint);
+	sigaction(SIGQUIT, &ign, &oldquit);
+
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		sigaction(SIGINT, &oldint, NULL);
+		sigaction(SIGQUIT, &oldquit, NULL);
+		if (showinc) {
+			dup2(outfd[1], 1);
+			close(outfd[0]);
+			close(outfd[1]);
+		}
+		if (tracing) {
+			close(tracefd[0]);
+			snprintf(tmp, sizeof(tmp), "%d", tracefd[1]);
+			setenv("MAKE_TRACEFD", tmp, 1);
+			s = getenv("LD_PRELOAD");
+			t = s && *s ? xconcat3(lib, ":", s) : lib;
+			setenv("LD_PRELOAD", t, 1);
+		}
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+
+	// Read output and trace records until the command finishes
+	npfd = 0;
+	if (showinc) {
+		close(outfd[1]);
+		outfd[1] = -1;
+		kind[npfd] = 'o';
+		pfd[npfd++] = (struct pollfd){outfd[0], POLLIN, 0};
+	}
+	if (tracing) {
+		close(tracefd[1]);
+		tracefd[1] = -1;
+		kind[npfd] = 't';
+		pfd[npfd++] = (struct pollfd){tracefd[0], POLLIN, 0};
+	}
+	exited = pid <= 0;
+	nopen = pid > 0 ? npfd : 0;
+	while (nopen) {
+		// Once the command has exited only read what's been written:
+		// background processes it started may hold the pipes open.
+		if (!exited && waitpid(pid, &status, WNOHANG) != 0)
+			exited = TRUE;
+		if ((ready = poll(pfd, npfd, exited ? 0 : 100)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (ready == 0) {
+			if (exited)
+				break;
+			continue;
+		}
+		for (i = 0; i < npfd; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+			if ((n = read(pfd[i].fd, tmp, sizeof(tmp))) < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				pfd[i].fd = -1;
+				nopen--;
+			} else {
+				bufadd(&buf[i], tmp, n);
+				lines(&buf[i], kind[i], prefix, cwd);
+			}
+		}
+	}
+	// Treat anything left as a complete line
+	for (i = 0; i < npfd; i++) {
+		if (buf[i].b_len) {
+			bufadd(&buf[i], "\n", 1);
+			lines(&buf[i], kind[i], prefix, cwd);
+		}
+	}
+	fflush(stdout);
+	if (!exited) {
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+	}
+	sigaction(SIGINT, &oldint, NULL);
+	sigaction(SIGQUIT, &oldquit, NULL);
+	captured = TRUE;
+
+ done:
+	for (i = 0; i < 2; i++) {
+		if (outfd[i] >= 0)
+			close(outfd[i]);
+		if (tracefd[i] >= 0)
+			close(tracefd[i]);
+		free(buf[i].b_str);
+	}
+	free(prefix);
+	free(lib);
+	return status;
+}
+
+/*
+ * Finish looking for the prerequisites of a target.  If any commands
+ * were run the files they read, apart from the target, replace its
+ * entry in the table.
+ */
+void
+enddeps(struct name *np, int ok)
+{
+	struct buffer buf = {NULL, 0, 0};
+	size_t i;
+
+	if (captured && ok) {
+		for (i = 0; i < nfound; i++) {
+			if (!found[i].f_written &&
+					strcmp(found[i].f_name, np->n_name) != 0)
+				addescaped(&buf, found[i].f_name);
+		}
+		setentry(np->n_name, buf.b_str ? buf.b_str : "");
+		free(buf.b_str);
+		depchanged = TRUE;
+	}
+
+	for (i = 0; i < nfound; i++)
+		free(found[i].f_name);
+	nfound = 0;
+	free(foundtab.h_slot);
+	foundtab = (struct htab){NULL, 0, 0};
+}
+#endif
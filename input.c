@@ -198,159 +198,412 @@ find_colon(char *p)
 }
 
 /*
- * Recursively expand any macros in str to an allocated string.
+ * A string containing macro expansions is compiled to a template:  a
+ * list of segments, each of which is either literal text or a macro
+ * reference.  References which don't contain nested expansions are
+ * fully parsed when the template is compiled so they can be expanded
+ * without further examination of the text.
  */
-char *
-expand_macros(const char *str, int except_dollar)
+#define TS_TEXT 0	// Literal text
+#define TS_REF  1	// Macro reference, parsed
+#define TS_EXPR 2	// Macro reference with nested expansions, unparsed
+
+struct tseg {
+	char *s_text;		// Literal text, macro name or unparsed reference
+	size_t s_len;		// Length of literal text
+	char *s_find;		// Text to find in a substitution or NULL
+	char *s_repl;		// Replacement text in a substitution
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	char *s_fpref;		// Pattern macro expansion: find text split
+	char *s_fsuff;		// at '%' (or NULL if there's no '%') ...
+	char *s_rpref;		// ... and replacement text split at '%'
+	char *s_rsuff;		// (or NULL if there's no '%')
+#endif
+	uint8_t s_type;		// Type of segment
+	char s_name[2];		// Storage for a single-character macro name
+};
+
+struct tmpl {
+	int t_nseg;			// Number of segments
+	bool t_literal;		// TRUE if there are no macro references
+	struct tseg t_seg[];
+};
+
+/*
+ * Compile a string to a template in memory obtained from alloc.
+ * Errors in macro references are reported at this stage, so callers
+ * should defer compilation until the string is first expanded.
+ */
+struct tmpl *
+compile_macros(const char *str, int except_dollar, void *(*alloc)(size_t))
 {
-	char *exp, *newexp, *s, *t, *p, *q, *name;
-	char *find, *replace, *modified;
-	char *expval, *expfind, *find_suff, *repl_suff;
+	const char *s;
+	char *text, *t, *p, *end;
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-	char *find_pref = NULL, *repl_pref = NULL;
+	char *spare;
+#endif
+	size_t len = strlen(str) + 1;
+	int nseg = 1;
+	struct tmpl *tp;
+	struct tseg *sp;
+
+	// Each '$' gives rise to at most a reference and a following
+	// piece of literal text.  The text of the template is stored
+	// after the segments, with spare room for split patterns.
+	for (s = str; (s = strchr(s, '$')) != NULL; s++)
+		nseg += 2;
+	tp = alloc(sizeof(struct tmpl) + nseg * sizeof(struct tseg) + 2 * len);
+	text = memcpy(tp->t_seg + nseg, str, len);
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	spare = text + len;
 #endif
-	size_t lenf, lenr;
-	char modifier;
-	struct macro *mp;
 
-	exp = xstrdup(str);
-	for (t = exp; *t; t++) {
-		if (*t == '$') {
-			if (t[1] == '\0') {
+	sp = tp->t_seg;
+	tp->t_literal = TRUE;
+	for (t = text; ; t = p) {
+		// Find the extent of any literal text
+		for (p = t; (p = strchr(p, '$')) != NULL; p++) {
+			if (p[1] == '\0') {
+				p = NULL;
 				break;
 			}
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-			if (t[1] == '$' && except_dollar) {
-				t++;
+			if (p[1] == '$' && except_dollar) {
+				p++;
 				continue;
 			}
 #endif
-			// Need to expand a macro.  Find its extent (s to t inclusive)
-			// and take a copy of its content.
-			s = t;
-			t++;
-			if (*t == '{' || *t == '(') {
-				t = find_char(t, *t == '{' ? '}' : ')');
-				if (t == NULL)
-					error("unterminated variable '%s'", s);
-				name = xstrndup(s + 2, t - s - 2);
-			} else {
-				name = xmalloc(2);
-				name[0] = *t;
-				name[1] = '\0';
-			}
+			break;
+		}
+		if (p ? p != t : *t != '\0') {
+			sp->s_type = TS_TEXT;
+			sp->s_text = t;
+			sp->s_len = p ? p - t : strlen(t);
+			sp++;
+		}
+		if (p == NULL)
+			break;
 
+		// Need to expand a macro.  Find its extent and take a note
+		// of its content.
+		tp->t_literal = FALSE;
+		memset(sp, 0, sizeof(*sp));
+		sp->s_type = TS_REF;
+		if (p[1] == '{' || p[1] == '(') {
+			end = find_char(p + 1, p[1] == '{' ? '}' : ')');
+			if (end == NULL)
+				error("unterminated variable '%s'", p);
+			*end = '\0';
+			sp->s_text = p + 2;
+			p = end + 1;
+		} else {
+			sp->s_name[0] = p[1];
+			sp->s_text = sp->s_name;
+			p += 2;
+			sp++;
+			continue;
+		}
+
+		if (strchr(sp->s_text, '$')) {
+			sp->s_type = TS_EXPR;
+		} else if ((sp->s_find = strchr(sp->s_text, ':'))) {
 			// Only do suffix replacement or pattern macro expansion
-			// if both ':' and '=' are found, plus a '%' for the latter.
-			// Suffix replacement is indicated by
-			// find_pref == NULL && (lenf != 0 || lenr != 0);
-			// pattern macro expansion by find_pref != NULL.
-			expfind = NULL;
-			find_suff = repl_suff = NULL;
-			lenf = lenr = 0;
-			if ((find = find_char(name, ':'))) {
-				*find++ = '\0';
-				expfind = expand_macros(find, FALSE);
-				if ((replace = find_char(expfind, '='))) {
-					*replace++ = '\0';
-					lenf = strlen(expfind);
+			// if both ':' and '=' are found.
+			*sp->s_find++ = '\0';
+			if ((sp->s_repl = strchr(sp->s_find, '='))) {
+				*sp->s_repl++ = '\0';
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-					if (!POSIX_2017 && (find_suff = strchr(expfind, '%'))) {
-						find_pref = expfind;
-						repl_pref = replace;
-						*find_suff++ = '\0';
-						if ((repl_suff = strchr(replace, '%')))
-							*repl_suff++ = '\0';
-					} else
-#endif
-					{
-						if (IF_FEATURE_MAKE_EXTENSIONS(posix &&
-									!(pragma & P_EMPTY_SUFFIX) &&)
-								lenf == 0)
-							error("empty suffix%s",
-								!ENABLE_FEATURE_MAKE_EXTENSIONS ? "" :
-									": allow with pragma empty_suffix");
-						find_suff = expfind;
-						repl_suff = replace;
-						lenr = strlen(repl_suff);
-					}
+				// Keep copies split at '%' in case this turns out
+				// to be a pattern macro expansion.
+				if (strchr(sp->s_find, '%')) {
+					sp->s_fpref = spare;
+					spare = stpcpy(spare, sp->s_find) + 1;
+					sp->s_fsuff = strchr(sp->s_fpref, '%');
+					*sp->s_fsuff++ = '\0';
+					sp->s_rpref = spare;
+					spare = stpcpy(spare, sp->s_repl) + 1;
+					if ((sp->s_rsuff = strchr(sp->s_rpref, '%')))
+						*sp->s_rsuff++ = '\0';
 				}
+#endif
+			} else {
+				sp->s_find = NULL;
 			}
+		}
+		sp->s_name[0] = sp->s_text[0];
+		sp++;
+	}
+	tp->t_nseg = sp - tp->t_seg;
+	return tp;
+}
 
-			p = q = name;
+/*
+ * The internal macros support 'D' and 'F' modifiers.  Return the
+ * modifier used in a macro name or NUL.
+ */
+static int
+get_modifier(const char *name)
+{
+	switch (name[0]) {
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-			// If not in POSIX mode expand macros in the name.
-			if (!POSIX_2017) {
-				char *expname = expand_macros(name, FALSE);
-				free(name);
-				name = expname;
-			} else
+	case '^':
+	case '+':
+		if (POSIX_2017)
+			break;
+		// fall through
+#endif
+	case '@': case '%': case '?': case '<': case '*':
+		if ((name[1] == 'D' || name[1] == 'F') && name[2] == '\0')
+			return name[1];
+		break;
+	}
+	return '\0';
+}
+
+#if !ENABLE_FEATURE_MAKE_POSIX_202X
+# define expand_ref(b, n, m, lf, lr, fp, rp, fs, rs) \
+			expand_ref(b, n, m, lf, lr, fs, rs)
+#endif
+// Set when an expansion refers to an internal macro
+static bool saw_internal;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+# define EXPAND_MODE (posix << 7 | pragma)
+#else
+# define EXPAND_MODE posix
+#endif
+
+/*
+ * Expand the value of a macro.  Values which don't depend on internal
+ * macros, even indirectly, are cached until any macro is changed.
+ * The result must not be freed or modified.
+ */
+static const char *
+expand_value(struct macro *mp)
+{
+	bool old_saw_internal = saw_internal;
+	uint32_t old_make = opts & OPT_make;
+
+	if (mp->m_cache && mp->m_cgen == macro_gen &&
+			mp->m_cmode == (uint8_t)EXPAND_MODE) {
+		opts |= mp->m_cmake;
+		return mp->m_cache;
+	}
+
+	free(mp->m_cache);
+	saw_internal = FALSE;
+	opts &= ~OPT_make;
+
+	if (mp->m_tmpl == NULL)
+		mp->m_tmpl = compile_macros(mp->m_val, FALSE, xmalloc);
+	mp->m_cache = expand_tmpl(mp->m_tmpl);
+	if (saw_internal || isinternal(mp->m_name))
+		mp->m_cgen = macro_gen - 1;		// Not cacheable
+	else
+		mp->m_cgen = macro_gen;
+	mp->m_cmode = EXPAND_MODE;
+	mp->m_cmake = opts & OPT_make;
+
+	saw_internal |= old_saw_internal;
+	opts |= old_make;
+	return mp->m_cache;
+}
+
+/*
+ * Append the expansion of a macro, with any modifier, suffix
+ * substitution or pattern macro expansion applied, to a buffer.
+ */
+static void
+expand_ref(struct buffer *bp, const char *name, int modifier,
+				size_t lenf, size_t lenr,
+				const char *find_pref, const char *repl_pref,
+				const char *find_suff, const char *repl_suff)
+{
+	struct macro *mp;
+	const char *expval = NULL;
+	char *modified;
+
+	// Internal macros are taken from the target being made
+	if (isinternal(name)) {
+		saw_internal = TRUE;
+		expval = getinternal(name[0]);
+	}
+
+	if (expval == NULL) {
+		if ((mp = getmp(name)) == NULL)
+			return;
+
+		// Recursive expansion
+		if (mp->m_flag)
+			error("recursive macro %s", name);
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+		// Note if we've expanded $(MAKE)
+		if (strcmp(name, "MAKE") == 0)
+			opts |= OPT_make;
 #endif
-			// Skip over nested expansions in name
-			do {
-				*q++ = *p;
-			} while ((p = skip_macro(p + 1)) && *p);
-
-			// The internal macros support 'D' and 'F' modifiers
-			modifier = '\0';
-			switch (name[0]) {
+		mp->m_flag = TRUE;
+		expval = expand_value(mp);
+		mp->m_flag = FALSE;
+	}
+
+	modified = modify_words(expval, modifier, lenf, lenr,
+					find_pref, repl_pref, find_suff, repl_suff);
+	if (modified) {
+		bufadd(bp, modified, strlen(modified));
+		free(modified);
+	} else {
+		bufadd(bp, expval, strlen(expval));
+	}
+}
+
+/*
+ * Expand a macro reference which contains nested expansions.  These
+ * may affect the name of the macro and the text of any substitution.
+ */
+static void
+expand_expr(struct buffer *bp, const char *ref)
+{
+	char *p, *q, *name;
+	char *find, *replace;
+	char *expfind, *find_suff, *repl_suff;
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-			case '^':
-			case '+':
-				if (POSIX_2017)
-					break;
-				// fall through
+	char *find_pref = NULL, *repl_pref = NULL;
 #endif
-			case '@': case '%': case '?': case '<': case '*':
-				if ((name[1] == 'D' || name[1] == 'F') && name[2] == '\0') {
-					modifier = name[1];
-					name[1] = '\0';
-				}
-				break;
-			}
+	size_t lenf, lenr;
+	char modifier;
 
-			modified = NULL;
-			if ((mp = getmp(name)))  {
-				// Recursive expansion
-				if (mp->m_flag)
-					error("recursive macro %s", name);
+	name = xstrdup(ref);
+
+	// Only do suffix replacement or pattern macro expansion
+	// if both ':' and '=' are found, plus a '%' for the latter.
+	// Suffix replacement is indicated by
+	// find_pref == NULL && (lenf != 0 || lenr != 0);
+	// pattern macro expansion by find_pref != NULL.
+	expfind = NULL;
+	find_suff = repl_suff = NULL;
+	lenf = lenr = 0;
+	if ((find = find_char(name, ':'))) {
+		*find++ = '\0';
+		expfind = expand_macros(find, FALSE);
+		if ((replace = find_char(expfind, '='))) {
+			*replace++ = '\0';
+			lenf = strlen(expfind);
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-				// Note if we've expanded $(MAKE)
-				if (strcmp(name, "MAKE") == 0)
-					opts |= OPT_make;
+			if (!POSIX_2017 && (find_suff = strchr(expfind, '%'))) {
+				find_pref = expfind;
+				repl_pref = replace;
+				*find_suff++ = '\0';
+				if ((repl_suff = strchr(replace, '%')))
+					*repl_suff++ = '\0';
+			} else
 #endif
-				mp->m_flag = TRUE;
-				expval = expand_macros(mp->m_val, FALSE);
-				mp->m_flag = FALSE;
-				modified = modify_words(expval, modifier, lenf, lenr,
-								find_pref, repl_pref, find_suff, repl_suff);
-				if (modified)
-					free(expval);
-				else
-					modified = expval;
+			{
+				if (IF_FEATURE_MAKE_EXTENSIONS(posix &&
+							!(pragma & P_EMPTY_SUFFIX) &&)
+						lenf == 0)
+					error("empty suffix%s",
+						!ENABLE_FEATURE_MAKE_EXTENSIONS ? "" :
+							": allow with pragma empty_suffix");
+				find_suff = expfind;
+				repl_suff = replace;
+				lenr = strlen(repl_suff);
 			}
-			free(name);
-			free(expfind);
+		}
+	}
 
-			if (modified && *modified) {
-				// The text to be replaced by the macro expansion is
-				// from s to t inclusive.
-				*s = '\0';
-				newexp = xconcat3(exp, modified, t + 1);
-				t = newexp + (s - exp) + strlen(modified) - 1;
-				free(exp);
-				exp = newexp;
-			} else {
-				// Macro wasn't expanded or expanded to nothing.
-				// Close the space occupied by the macro reference.
-				q = t + 1;
-				t = s - 1;
-				while ((*s++ = *q++))
-					continue;
+	p = q = name;
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	// If not in POSIX mode expand macros in the name.
+	if (!POSIX_2017) {
+		char *expname = expand_macros(name, FALSE);
+		free(name);
+		name = expname;
+	} else
+#endif
+	// Skip over nested expansions in name
+	do {
+		*q++ = *p;
+	} while ((p = skip_macro(p + 1)) && *p);
+
+	if ((modifier = get_modifier(name)))
+		name[1] = '\0';
+
+	expand_ref(bp, name, modifier, lenf, lenr,
+				find_pref, repl_pref, find_suff, repl_suff);
+	free(name);
+	free(expfind);
+}
+
+/*
+ * Expand a template to an allocated string.
+ */
+char *
+expand_tmpl(const struct tmpl *tp)
+{
+	struct buffer buf = {NULL, 0, 0};
+	const struct tseg *sp;
+	const char *name;
+	size_t lenf, lenr;
+	char modifier;
+
+	if (tp->t_literal)
+		return xstrdup(tp->t_nseg ? tp->t_seg[0].s_text : "");
+
+	for (sp = tp->t_seg; sp < tp->t_seg + tp->t_nseg; sp++) {
+		switch (sp->s_type) {
+		case TS_TEXT:
+			bufadd(&buf, sp->s_text, sp->s_len);
+			break;
+		case TS_REF:
+			modifier = get_modifier(sp->s_text);
+			name = modifier ? sp->s_name : sp->s_text;
+			if (sp->s_find == NULL) {
+				expand_ref(&buf, name, modifier, 0, 0,
+							NULL, NULL, NULL, NULL);
+				break;
+			}
+			lenf = strlen(sp->s_find);
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+			if (!POSIX_2017 && sp->s_fsuff) {
+				expand_ref(&buf, name, modifier, lenf, 0,
+							sp->s_fpref, sp->s_rpref,
+							sp->s_fsuff, sp->s_rsuff);
+				break;
 			}
-			free(modified);
+#endif
+			if (IF_FEATURE_MAKE_EXTENSIONS(posix &&
+						!(pragma & P_EMPTY_SUFFIX) &&)
+					lenf == 0)
+				error("empty suffix%s",
+					!ENABLE_FEATURE_MAKE_EXTENSIONS ? "" :
+						": allow with pragma empty_suffix");
+			lenr = strlen(sp->s_repl);
+			expand_ref(&buf, name, modifier, lenf, lenr,
+						NULL, NULL, sp->s_find, sp->s_repl);
+			break;
+		case TS_EXPR:
+			expand_expr(&buf, sp->s_text);
+			break;
 		}
 	}
+	return buf.b_str ? buf.b_str : xstrdup("");
+}
+
+/*
+ * Recursively expand any macros in str to an allocated string.
+ */
+char *
+expand_macros(const char *str, int except_dollar)
+{
+	struct tmpl *tp;
+	char *exp;
+
+	if (strchr(str, '$') == NULL)
+		return xstrdup(str);
+
+	tp = compile_macros(str, except_dollar, xmalloc);
+	exp = expand_tmpl(tp);
+	free(tp);
 	return exp;
 }
 
@@ -573,24 +826,15 @@ readline(FILE *fd)
 }
 
 /*
- * Return TRUE if the argument is a known suffix.
+ * Return TRUE if the argument is a known suffix.  Names are flagged
+ * as they're added to or removed from .SUFFIXES.
  */
 static int
 is_suffix(const char *s)
 {
-	struct name *np;
-	struct rule *rp;
-	struct depend *dp;
-
-	np = newname(".SUFFIXES");
-	for (rp = np->n_rule; rp; rp = rp->r_next) {
-		for (dp = rp->r_dep; dp; dp = dp->d_next) {
-			if (strcmp(s, dp->d_name->n_name) == 0) {
-				return TRUE;
-			}
-		}
-	}
-	return FALSE;
+	struct name *np = findname(s);
+
+	return np && (np->n_flag & N_SUFFIX);
 }
 
 #define T_NORMAL 0
@@ -606,30 +850,72 @@ target_type(char *s)
 {
 	char *sfx;
 	int ret;
-	static const char *s_name[] = {
-		".DEFAULT",
-		".POSIX",
-		".IGNORE",
-		".PRECIOUS",
-		".SILENT",
-		".SUFFIXES",
-#if ENABLE_FEATURE_MAKE_POSIX_202X
-		".PHONY",
-		".NOTPARALLEL",
-		".WAIT",
-#endif
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-		".PRAGMA",
-#endif
-	};
+	const char *special = NULL;
 
 	if (*s != '.' && strchr(s, '%') == NULL)
 		return T_NORMAL;
 
-	// Check for one of the known special targets
-	for (ret = 0; ret < sizeof(s_name)/sizeof(s_name[0]); ret++)
-		if (strcmp(s_name[ret], s) == 0)
-			return T_SPECIAL;
+	// Check for one of the known special targets.  At most one of
+	// them can match, determined by the first few characters.
+	switch (s[1]) {
+	case 'D':
+		special = ".DEFAULT";
+		break;
+	case 'I':
+		if (s[2] == 'G')
+			special = ".IGNORE";
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		else if (s[2] == 'N')
+			special = ".INTERMEDIATE";
+#endif
+		break;
+	case 'P':
+		if (s[2] == 'O')
+			special = ".POSIX";
+		else if (s[2] == 'R' && s[3] == 'E')
+			special = ".PRECIOUS";
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		else if (s[2] == 'R')
+			special = ".PRAGMA";
+#endif
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+		else if (s[2] == 'H')
+			special = ".PHONY";
+#endif
+		break;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	case 'R':
+		special = ".RESPONSE";
+		break;
+#endif
+	case 'S':
+		if (s[2] == 'I')
+			special = ".SILENT";
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		else if (s[2] == 'H')
+			special = ".SHOWINCLUDES";
+		else if (s[2] == 'E')
+			special = ".SECONDARY";
+#endif
+		else if (s[2] == 'U')
+			special = ".SUFFIXES";
+		break;
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	case 'N':
+		special = ".NOTPARALLEL";
+		break;
+	case 'W':
+		special = ".WAIT";
+		break;
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	case 'T':
+		special = ".TRACEDEPS";
+		break;
+#endif
+	}
+	if (special && strcmp(special, s) == 0)
+		return T_SPECIAL;
 
 	// Check for an inference rule
 	ret = T_NORMAL;
@@ -644,7 +930,8 @@ target_type(char *s)
 				ret = T_INFERENCE;
 			else if (strchr(s, '%')) { // Suffix pattern?
 				// Add to .SUFFIXES, so it can be used for inference
-				addrule(newname(".SUFFIXES"), newdep(newname(s), NULL), NULL, 0);
+				newdep(newname(s));
+				addrule(newname(".SUFFIXES"), nedge - 1, 1, NULL, 0);
 				ret = T_INFERENCE;
 			}
 			*sfx = '.';
@@ -839,6 +1126,124 @@ wildcard(char *p, glob_t *gd)
 }
 #endif
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Add the rules from a dependency file, as written by a compiler's
+ * -MD or -MMD option, to the graph.  Only the restricted syntax of
+ * such files is accepted:  lines of targets, a colon and prerequisites
+ * with backslash-newline continuations, '\ ' and '\#' escapes and '$$'
+ * for a dollar.  There's no macro expansion.  If 'db' is TRUE the file
+ * is the database of dependencies found by make.  Return FALSE if the
+ * file can't be read.
+ */
+int
+readdeps(const char *file, int db)
+{
+	FILE *fd;
+	const char *old_makefile = makefile;
+	int old_lineno = lineno;
+	struct buffer buf = {NULL, 0, 0};
+	struct name **targets = NULL;
+	size_t n, ntarget = 0, maxtarget = 0;
+	char tmp[BUFSIZ];
+	char *s, *t, *word = NULL;
+	uint32_t dep = nedge;
+	bool intarget = TRUE;
+	char c;
+
+	if ((fd = fopen(file, "r")) == NULL)
+		return FALSE;
+	while ((n = fread(tmp, 1, sizeof(tmp), fd)) > 0)
+		bufadd(&buf, tmp, n);
+	fclose(fd);
+	bufadd(&buf, "\n", 1);	// Ensure the last line is complete
+
+	makefile = file;
+	lineno = 1;
+	for (s = t = buf.b_str; s < buf.b_str + buf.b_len; ) {
+		if (*s == '\\' && (s[1] == ' ' || s[1] == '#')) {
+			// Escaped character, part of a word
+			if (!word)
+				word = t;
+			s++;
+			*t++ = *s++;
+			continue;
+		} else if (*s == '$' && s[1] == '$') {
+			if (!word)
+				word = t;
+			*t++ = '$';
+			s += 2;
+			continue;
+		} else if (*s == '#') {
+			// Comment, skip to end of line
+			while (*s != '\n')
+				s++;
+		} else if (*s == ':' && intarget &&
+					(isspace(s[1]) || (s[1] == '\\' && s[2] == '\n'))) {
+			// Separator between targets and prerequisites
+		} else if (!(isspace(*s) ||
+					(*s == '\\' && (s[1] == '\n' ||
+						(s[1] == '\r' && s[2] == '\n'))))) {
+			if (!word)
+				word = t;
+			*t++ = *s++;
+			continue;
+		}
+
+		// Anything else ends a word.  The terminator may overwrite
+		// the current character, so save it.
+		c = *s;
+		if (word) {
+			*t++ = '\0';
+			if (intarget) {
+				if (ntarget == maxtarget) {
+					maxtarget = MAX(2 * maxtarget, 8);
+					targets = xrealloc(targets, maxtarget * sizeof(*targets));
+				}
+				targets[ntarget++] = newname(word);
+			} else {
+				newdep(newname(word));
+			}
+			word = NULL;
+		}
+
+		if (c == ':') {
+			if (ntarget == 0)
+				error("expected target");
+			intarget = FALSE;
+			dep = nedge;
+		} else if (c == '\n') {
+			if (!intarget) {
+				for (n = 0; n < ntarget; n++) {
+					// Recorded prerequisites can't be added to
+					// double-colon rules, which are separate
+					if (!db || !(targets[n]->n_flag & N_DOUBLE))
+						addrule(targets[n], dep, nedge - dep, NULL, FALSE);
+					if (db)
+						dbrule(targets[n], dep, nedge - dep);
+				}
+				intarget = TRUE;
+			} else if (ntarget) {
+				error("expected separator");
+			}
+			ntarget = 0;
+			lineno++;
+		} else if (c == '\\') {
+			// Continuation line
+			s += s[1] == '\r';
+			s++;
+			lineno++;
+		}
+		s++;
+	}
+	free(targets);
+	free(buf.b_str);
+	makefile = old_makefile;
+	lineno = old_lineno;
+	return TRUE;
+}
+#endif
+
 /*
  * Parse input from the makefile and construct a tree structure of it.
  */
@@ -848,13 +1253,15 @@ input(FILE *fd, int ilevel)
 	char *p, *q, *s, *a, *str, *expanded, *copy;
 	char *str1, *str2;
 	struct name *np;
-	struct depend *dp;
-	struct cmd *cp;
+	uint32_t dep, ndep;
+	struct cmd *cp, **cpp;
 	int startno, count;
 	bool semicolon_cmd, seen_inference;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	uint8_t old_clevel = clevel;
-	bool dbl;
+	bool dbl, pattern, ordered, grouped;
+	uint32_t order = 0, norder, ngroup;
+	struct name **group = NULL;
 	char *lib = NULL;
 	glob_t gd;
 	int nfile, i;
@@ -940,11 +1347,40 @@ input(FILE *fd, int ilevel)
 			goto end_loop;
 		}
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// Check for a dinclude line, which reads dependency files
+		p = str + (*str == '-');
+		if (!posix && strncmp(p, "dinclude", 8) == 0 && isblank(p[8])) {
+			q = expanded = expand_macros(p + 8, FALSE);
+			while ((p = gettok(&q)) != NULL) {
+				if (!readdeps(p, FALSE) && *str != '-')
+					error("can't open include file '%s'", p);
+			}
+			goto end_loop;
+		}
+
+		// Check for a vpath directive
+		if (!posix && strncmp(str, "vpath", 5) == 0 &&
+				(isblank(str[5]) || str[5] == '\0') &&
+				find_char(str, '=') == NULL) {
+			q = expanded = expand_macros(str + 5, FALSE);
+			p = gettok(&q);
+			while (isspace(*q))
+				q++;
+			setvpath(p, *q ? q : NULL);
+			goto end_loop;
+		}
+#endif
+
 		// Check for target rule
 		a = p = expanded = expand_macros(str, FALSE);
 		if ((q = find_colon(p)) != NULL) {
 			// All tokens before ':' must be valid targets
 			*q = '\0';
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (!posix && q > p && q[-1] == '&')
+				q[-1] = '\0';
+#endif
 			while ((a = gettok(&p)) != NULL && is_valid_target(a))
 				;
 		}
@@ -962,25 +1398,35 @@ input(FILE *fd, int ilevel)
 			*q++ = '\0';	// Separate targets and prerequisites
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
+			// Grouped targets, made together by one set of commands
+			grouped = !posix && q - 1 > p && q[-2] == '&';
+			if (grouped)
+				q[-2] = '\0';
+
 			// Double colon
 			dbl = !posix && *q == ':';
-			if (dbl)
+			if (dbl) {
+				if (grouped)
+					error("grouped targets can't be double-colon");
 				q++;
+			}
 #endif
 
 			// Look for semicolon separator
 			cp = NULL;
+			cpp = &cp;
 			s = strchr(q, ';');
 			if (s) {
 				*s = '\0';
 				// Retrieve command from copy of line
 				if ((p = find_char(copy, ':')) && (p = strchr(p, ';')))
-					cp = newcmd(process_command(p + 1), cp);
+					cpp = newcmd(process_command(p + 1), cpp);
 			}
 			semicolon_cmd = cp != NULL;
 
 			// Create list of prerequisites
-			dp = NULL;
+			dep = nedge;
+			IF_FEATURE_MAKE_EXTENSIONS(ordered = FALSE;)
 			while (((p = gettok(&q)) != NULL)) {
 #if !ENABLE_FEATURE_MAKE_EXTENSIONS
 # if ENABLE_FEATURE_MAKE_POSIX_202X
@@ -988,11 +1434,18 @@ input(FILE *fd, int ilevel)
 					continue;
 # endif
 				np = newname(p);
-				dp = newdep(np, dp);
+				newdep(np);
 #else
 				char *newp = NULL;
 
 				if (!posix) {
+					// Prerequisites after '|' are order-only
+					if (!ordered && !lib && strcmp(p, "|") == 0) {
+						ordered = TRUE;
+						order = nedge;
+						continue;
+					}
+
 					// Allow prerequisites of form library(member1 member2).
 					// Leading and trailing spaces in the brackets are skipped.
 					if (!lib) {
@@ -1032,21 +1485,33 @@ input(FILE *fd, int ilevel)
 						continue;
 # endif
 					np = newname(files[i]);
-					dp = newdep(np, dp);
+					newdep(np);
 				}
 				if (files != &p)
 					globfree(&gd);
 				free(newp);
 #endif /* ENABLE_FEATURE_MAKE_EXTENSIONS */
 			}
+			ndep = nedge - dep;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 			lib = NULL;
+			norder = ordered ? nedge - order : 0;
+
+			// A '%' in a prerequisite makes targets with a '%' into
+			// pattern rules.
+			pattern = FALSE;
+			if (!posix) {
+				for (i = 0; i < ndep; i++) {
+					if (strchr(namev[edges[dep + i]]->n_name, '%'))
+						pattern = TRUE;
+				}
+			}
 #endif
 
 			// Create list of commands
 			startno = dispno;
 			while ((str2 = readline(fd)) && *str2 == '\t') {
-				cp = newcmd(process_command(str2), cp);
+				cpp = newcmd(process_command(str2), cpp);
 				free(str2);
 			}
 			dispno = startno;
@@ -1054,6 +1519,7 @@ input(FILE *fd, int ilevel)
 			// Create target names and attach rule to them
 			q = expanded;
 			count = 0;
+			IF_FEATURE_MAKE_EXTENSIONS(ngroup = 0;)
 			seen_inference = FALSE;
 			while ((p = gettok(&q)) != NULL) {
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -1068,8 +1534,16 @@ input(FILE *fd, int ilevel)
 # define p files[i]
 #endif
 				{
-					int ttype = target_type(p);
+					int ttype;
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+					if (pattern && strchr(p, '%')) {
+						addpattern(p, dep, ndep, norder, cp);
+						count++;
+						continue;
+					}
+#endif
+					ttype = target_type(p);
 					np = newname(p);
 					if (ttype != T_NORMAL) {
 						if (ttype == T_INFERENCE
@@ -1079,10 +1553,31 @@ input(FILE *fd, int ilevel)
 							seen_inference = TRUE;
 						}
 						np->n_flag |= N_SPECIAL;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+						// A double-colon inference rule is run in batch
+						// mode.  It replaces any single-colon rule.
+						if (ttype == T_INFERENCE && dbl) {
+							struct cmd *bcp;
+
+							for (bcp = cp; bcp; bcp = bcp->c_next)
+								bcp->c_batch = TRUE;
+							addrule(np, dep, ndep, cp, FALSE);
+							count++;
+							continue;
+						}
+#endif
 					} else if (!firstname) {
 						firstname = np;
 					}
-					addrule(np, dp, cp, dbl);
+					addrule(np, dep, ndep, cp, dbl);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+					if (norder)
+						np->n_lastrule->r_norder = norder;
+					if (grouped) {
+						group = xrealloc(group, (ngroup + 1) * sizeof(*group));
+						group[ngroup++] = np;
+					}
+#endif
 					count++;
 				}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -1093,13 +1588,19 @@ input(FILE *fd, int ilevel)
 			}
 			if (seen_inference && count != 1)
 				error_in_inference_rule("multiple targets");
-
-			// Prerequisites and commands will be unused if there were
-			// no targets.  Avoid leaking memory.
-			if (count == 0) {
-				freedeps(dp);
-				freecmds(cp);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			// The targets of a group are a range of edges[], like
+			// prerequisites
+			if (grouped && cp && ngroup > 1) {
+				cp->c_group = nedge;
+				cp->c_ngroup = ngroup;
+				for (i = 0; i < (int)ngroup; i++)
+					newdep(group[i]);
 			}
+			free(group);
+			group = NULL;
+#endif
+
 			goto end_loop;
 		}
 
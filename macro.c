@@ -3,17 +3,14 @@
  */
 #include "make.h"
 
-struct macro *macrohead[HTABSIZE];
+struct htab macrotab;
+// Incremented whenever a macro which isn't internal is changed
+unsigned int macro_gen;
 
 struct macro *
 getmp(const char *name)
 {
-	struct macro *mp;
-
-	for (mp = macrohead[getbucket(name)]; mp; mp = mp->m_next)
-		if (strcmp(name, mp->m_name) == 0)
-			return mp;
-	return NULL;
+	return hfind(&macrotab, name);
 }
 
 static int
@@ -74,10 +71,9 @@ setmacro(const char *name, const char *val, int level)
 
 		// Replace existing macro
 		free(mp->m_val);
+		free(mp->m_tmpl);
 	} else {
 		// If not defined, allocate space for new
-		unsigned int bucket;
-
 		if (!valid && !is_valid_macro(name))
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 			error("invalid macro name '%s'%s", name,
@@ -87,34 +83,38 @@ setmacro(const char *name, const char *val, int level)
 			error("invalid macro name '%s'", name);
 #endif
 
-		bucket = getbucket(name);
 		mp = xmalloc(sizeof(struct macro));
-		mp->m_next = macrohead[bucket];
-		macrohead[bucket] = mp;
 		mp->m_flag = FALSE;
 		mp->m_name = xstrdup(name);
+		mp->m_cache = NULL;
+		hinsert(&macrotab, mp->m_name, mp);
 	}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_202X
 	mp->m_immediate = immediate;
 #endif
 	mp->m_level = level;
 	mp->m_val = xstrdup(val ? val : "");
+	mp->m_tmpl = NULL;	// Compiled when first expanded
+	if (!isinternal(name))
+		macro_gen++;	// Invalidate cached expansions
 }
 
 #if ENABLE_FEATURE_CLEAN_UP
 void
 freemacros(void)
 {
-	int i;
-	struct macro *mp, *nextmp;
+	unsigned int i;
+	struct macro *mp;
 
-	for (i = 0; i < HTABSIZE; i++) {
-		for (mp = macrohead[i]; mp; mp = nextmp) {
-			nextmp = mp->m_next;
+	for (i = 0; i < macrotab.h_size; i++) {
+		if ((mp = macrotab.h_slot[i].h_data)) {
 			free(mp->m_name);
 			free(mp->m_val);
+			free(mp->m_tmpl);
+			free(mp->m_cache);
 			free(mp);
 		}
 	}
+	free(macrotab.h_slot);
 }
 #endif
@@ -24,6 +24,7 @@ uint32_t opts;
 const char *myname;
 const char *makefile;
 struct file *makefiles;
+static struct file **lastfile = &makefiles;
 bool posix;
 bool seen_first;
 #if ENABLE_FEATURE_MAKE_POSIX_202X
@@ -76,7 +77,7 @@ process_options(int argc, char **argv, int from_env)
 #endif
 		case 'f':	// Alternate file name
 			if (!from_env) {
-				makefiles = newfile(optarg, makefiles);
+				lastfile = newfile(optarg, lastfile);
 				flags |= OPT_f;
 			}
 			break;
@@ -294,11 +295,13 @@ update_makeflags(void)
 		i++;
 	}
 
-	for (i = 0; i < HTABSIZE; ++i) {
-		for (mp = macrohead[i]; mp; mp = mp->m_next) {
+	for (i = 0; i < macrotab.h_size; ++i) {
+		if ((mp = macrotab.h_slot[i].h_data)) {
 			if ((mp->m_level == 1 || mp->m_level == 2) &&
 					strcmp(mp->m_name, "MAKEFLAGS") != 0) {
-				macro = xmalloc(strlen(mp->m_name) + 2 * strlen(mp->m_val) + 1);
+				// Name, '=', value with escapes and terminating NUL
+				macro = xmalloc(strlen(mp->m_name) + 1 +
+								2 * strlen(mp->m_val) + 1);
 				s = stpcpy(macro, mp->m_name);
 				*s++ = '=';
 				for (t = mp->m_val; *t; t++) {
@@ -330,6 +333,9 @@ make_handler(int sig)
 {
 	signal(sig, SIG_DFL);
 	remove_target();
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	unlink_responses();
+#endif
 	kill(getpid(), sig);
 }
 
@@ -357,13 +363,13 @@ mark_special(const char *special, uint32_t oflag, uint16_t nflag)
 {
 	struct name *np;
 	struct rule *rp;
-	struct depend *dp;
+	uint32_t i;
 	int marked = FALSE;
 
 	if (!(opts & oflag) && (np = findname(special))) {
 		for (rp = np->n_rule; rp; rp = rp->r_next) {
-			for (dp = rp->r_dep; dp; dp = dp->d_next) {
-				dp->d_name->n_flag |= nflag;
+			for (i = 0; i < rp->r_ndep; i++) {
+				getdep(rp, i)->n_flag |= nflag;
 				marked = TRUE;
 			}
 		}
@@ -454,6 +460,9 @@ main(int argc, char **argv)
 
 	// Read built-in rules
 	input(NULL, 0);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	mark_arcmds();
+#endif
 
 	setmacro("SHELL", "/bin/sh", 4);
 	setmacro("MAKE", path, 4);
@@ -498,6 +507,17 @@ main(int argc, char **argv)
 	if (!POSIX_2017)
 		mark_special(".PHONY", OPT_phony, N_PHONY);
 #endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (!posix) {
+		mark_special(".SHOWINCLUDES", OPT_showinc, N_SHOWINC);
+		mark_special(".TRACEDEPS", OPT_trace, N_TRACE);
+		mark_special(".INTERMEDIATE", OPT_intermediate,
+						N_INTERMEDIATE | N_REMOVE);
+		mark_special(".SECONDARY", OPT_secondary,
+						N_INTERMEDIATE | N_SECONDARY);
+		loaddeps();
+	}
+#endif
 
 	estat = 0;
 	if (*argv == NULL) {
@@ -513,8 +533,13 @@ main(int argc, char **argv)
 # if ENABLE_FEATURE_MAKE_POSIX_202X
 	free((void *)numjobs);
 # endif
+# if ENABLE_FEATURE_MAKE_EXTENSIONS
+	freevpath();
+# endif
+	freearchives();
 	freenames();
 	freemacros();
+	freesuffrules();
 	freefiles(makefiles);
 #endif
 
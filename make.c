@@ -5,6 +5,9 @@
 
 struct name *target;
 
+// Incremented whenever commands are run
+unsigned int run_gen;
+
 void
 remove_target(void)
 {
@@ -15,97 +18,364 @@ remove_target(void)
 	}
 }
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// Response files, indexed by their contents.  Their names are also
+// kept in a list the signal handler can use.
+static struct htab resptab;
+static char **respfile;
+static volatile sig_atomic_t nrespfile;
+static size_t maxrespfile;
+
+// Output of commands is being captured to find included files
+static bool capturing;
+
 /*
- * Do commands to make a target
+ * Unlink the response files.  This is called from the signal handler
+ * so must only use async-signal-safe functions.
  */
-static int
-docmds(struct name *np, struct cmd *cp)
+void
+unlink_responses(void)
 {
-	int estat = 0;
-	char *q, *command;
+	sig_atomic_t i;
 
-	for (; cp; cp = cp->c_next) {
-		uint8_t ssilent, signore, sdomake;
+	for (i = 0; i < nrespfile; i++)
+		unlink(respfile[i]);
+}
 
-		// Location of command in makefile (for use in error messages)
-		makefile = cp->c_makefile;
-		dispno = cp->c_dispno;
-#if ENABLE_FEATURE_MAKE_POSIX_202X
-		opts &= ~OPT_make;	// We want to know if $(MAKE) is expanded
-#endif
-		q = command = expand_macros(cp->c_cmd, FALSE);
-		ssilent = silent || (np->n_flag & N_SILENT) || dotouch;
-		signore = ignore || (np->n_flag & N_IGNORE);
-		sdomake = (!dryrun || doinclude || domake) && !dotouch;
-		for (;;) {
-			if (*q == '@')	// Specific silent
-				ssilent = TRUE + 1;
-			else if (*q == '-')	// Specific ignore
-				signore = TRUE;
-			else if (*q == '+')	// Specific domake
-				sdomake = TRUE + 1;
-			else
-				break;
-			q++;
+/*
+ * Remove the response files and free the table.
+ */
+static void
+remove_responses(void)
+{
+	unsigned int i;
+
+	unlink_responses();
+	nrespfile = 0;
+	for (i = 0; i < resptab.h_size; i++) {
+		if (resptab.h_slot[i].h_data) {
+			free(resptab.h_slot[i].h_data);
+			free((char *)resptab.h_slot[i].h_key);
+		}
+	}
+	free(resptab.h_slot);
+	resptab = (struct htab){NULL, 0, 0};
+	free(respfile);
+	respfile = NULL;
+	maxrespfile = 0;
+}
+
+/*
+ * Add a response file to the list.  A larger list is filled in before
+ * it replaces the old one, so the signal handler always sees a
+ * complete list.
+ */
+static void
+addresponse(char *file)
+{
+	char **list, **old = respfile;
+
+	if ((size_t)nrespfile == maxrespfile) {
+		maxrespfile = MAX(2 * maxrespfile, 8);
+		list = xmalloc(maxrespfile * sizeof(*list));
+		if (nrespfile)
+			memcpy(list, old, nrespfile * sizeof(*list));
+		respfile = list;
+		free(old);
+	}
+	respfile[nrespfile] = file;
+	nrespfile = nrespfile + 1;
+}
+
+/*
+ * If a long command is one of the prerequisites of .RESPONSE, and
+ * its arguments can be passed without the shell, write them to a
+ * response file.  Return a command which refers to the file, or
+ * NULL if the command should be run as it is.  The same file is used
+ * for all commands with the same arguments.
+ */
+static char *
+response(const char *q)
+{
+	struct name *np = findname(".RESPONSE");
+	struct rule *rp;
+	const char *args, *base, *name;
+	char *word, *file, *s, *cmd = NULL;
+	long max;
+	uint32_t i;
+	int fd;
+
+	if (np == NULL || np->n_rule == NULL)
+		return NULL;
+
+	s = expand_macros("$(RESPONSESIZE)", FALSE);
+	max = *s ? strtol(s, NULL, 10) : 32768;
+	free(s);
+	args = q + strcspn(q, " \t");
+	if ((long)strlen(q) <= max || *args == '\0' ||
+			strpbrk(args, "\"'\\$`;&|<>()*?[]#~\n"))
+		return NULL;
+
+	word = xstrndup(q, args - q);
+	base = strrchr(word, '/') ? strrchr(word, '/') + 1 : word;
+	args += strspn(args, " \t");
+	for (rp = np->n_rule; rp && !cmd; rp = rp->r_next) {
+		for (i = 0; i < rp->r_ndep; i++) {
+			name = getdep(rp, i)->n_name;
+			if (strcmp(name, word) != 0 && strcmp(name, base) != 0)
+				continue;
+
+			if ((file = hfind(&resptab, args)) == NULL) {
+				if (resptab.h_size == 0)
+					atexit(remove_responses);
+				s = getenv("TMPDIR");
+				file = xconcat3(s && *s ? s : "/tmp", "/makeXXXXXX", "");
+				if ((fd = mkstemp(file)) < 0)
+					error("can't create response file: %s", strerror(errno));
+				addresponse(file);
+				if (write(fd, args, strlen(args)) < 0 || write(fd, "\n", 1) < 0)
+					error("can't write response file: %s", strerror(errno));
+				close(fd);
+				hinsert(&resptab, xstrdup(args), file);
+			}
+			cmd = xconcat3(word, " @", file);
+			break;
 		}
+	}
+	free(word);
+	return cmd;
+}
+#endif
+
+/*
+ * Do a command, which may have '@', '-' and '+' prefixes, for a
+ * target.  Return the updated exit status.
+ */
+static int
+docmd(struct name *np, char *q, int estat)
+{
+	uint8_t ssilent, signore, sdomake;
 
-		if (sdomake > TRUE) {
-			// '+' must not override '@' or .SILENT
-			if (ssilent != TRUE + 1 && !(np->n_flag & N_SILENT))
-				ssilent = FALSE;
-		} else if (!sdomake)
-			ssilent = dotouch;
+	ssilent = silent || (np->n_flag & N_SILENT) || dotouch;
+	signore = ignore || (np->n_flag & N_IGNORE);
+	sdomake = (!dryrun || doinclude || domake) && !dotouch;
+	for (;;) {
+		if (*q == '@')	// Specific silent
+			ssilent = TRUE + 1;
+		else if (*q == '-')	// Specific ignore
+			signore = TRUE;
+		else if (*q == '+')	// Specific domake
+			sdomake = TRUE + 1;
+		else
+			break;
+		q++;
+	}
 
-		if (!ssilent)
-			puts(q);
+	if (sdomake > TRUE) {
+		// '+' must not override '@' or .SILENT
+		if (ssilent != TRUE + 1 && !(np->n_flag & N_SILENT))
+			ssilent = FALSE;
+	} else if (!sdomake)
+		ssilent = dotouch;
 
-		if (sdomake) {
-			// Get the shell to execute it
-			int status;
-			char *cmd = !signore ? xconcat3("set -e;", q, "") : q;
+	if (!ssilent)
+		puts(q);
 
-			target = np;
+	if (sdomake) {
+		// Get the shell to execute it
+		int status;
+		char *cmd, *resp = NULL;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// Pass long argument lists in a file if allowed
+		if (!posix && (resp = response(q)))
+			q = resp;
+#endif
+		cmd = !signore ? xconcat3("set -e;", q, "") : q;
+
+		target = np;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (capturing)
+			status = capture(cmd);
+		else
+#endif
 			status = system(cmd);
-			// If this command was being run to create an include file
-			// or bring it up-to-date errors should be ignored and a
-			// failure status returned.
-			if (status == -1 && !doinclude) {
-				error("couldn't execute '%s'", q);
-			} else if (status != 0 && !signore) {
+		// If this command was being run to create an include file
+		// or bring it up-to-date errors should be ignored and a
+		// failure status returned.
+		if (status == -1 && !doinclude) {
+			error("couldn't execute '%s'", q);
+		} else if (status != 0 && !signore) {
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-				if (!posix && WIFSIGNALED(status))
-					remove_target();
-#endif
-				if (errcont || doinclude) {
-					warning("failed to build '%s'", np->n_name);
-					estat |= MAKE_FAILURE;
-				} else {
-					const char *err_type = NULL;
-					int err_value;
-
-					if (WIFEXITED(status)) {
-						err_type = "exit";
-						err_value = WEXITSTATUS(status);
-					} else if (WIFSIGNALED(status)) {
-						err_type = "signal";
-						err_value = WTERMSIG(status);
-					}
-
-					if (err_type)
-						error("failed to build '%s' %s %d", np->n_name,
-								err_type, err_value);
-					else
-						error("failed to build '%s'", np->n_name);
+			if (!posix && WIFSIGNALED(status))
+				remove_target();
+#endif
+			if (errcont || doinclude) {
+				warning("failed to build '%s'", np->n_name);
+				estat |= MAKE_FAILURE;
+			} else {
+				const char *err_type = NULL;
+				int err_value;
+
+				if (WIFEXITED(status)) {
+					err_type = "exit";
+					err_value = WEXITSTATUS(status);
+				} else if (WIFSIGNALED(status)) {
+					err_type = "signal";
+					err_value = WTERMSIG(status);
 				}
+
+				if (err_type)
+					error("failed to build '%s' %s %d", np->n_name,
+							err_type, err_value);
+				else
+					error("failed to build '%s'", np->n_name);
 			}
-			target = NULL;
-			if (!signore)
-				free(cmd);
 		}
-		if (sdomake || dryrun || dotouch)
+		target = NULL;
+		if (!signore)
+			free(cmd);
+		free(resp);
+	}
+	if (sdomake || dryrun || dotouch)
+		estat |= MAKE_DIDSOMETHING;
+	return estat;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// Updates of an archive are deferred so it's only rewritten once for
+// all the members made in succession.  A deferred command is split
+// into its last word and the text before it:  the last words of
+// commands with the same text are gathered into a single command.
+struct batch {
+	struct batch *b_next;
+	struct name *b_target;	// First target, for its flags
+	char *b_cmd;			// Command without last word
+	struct buffer b_args;	// Last words
+};
+
+static struct batch *batches, **lastbatch = &batches;
+static char *batchlib;		// Archive whose updates are deferred
+
+// Targets which use a batch-mode inference rule are deferred and made
+// together.  $@, $< and $* are the lists of targets, implicit
+// prerequisites and stems; $?, $^ and $+ are the values for each
+// target joined together.
+struct group {
+	struct group *g_next;
+	struct cmd *g_cmd;		// Commands of rule
+	char *g_key;			// Commands expanded without internal macros
+	struct name **g_name;	// Targets
+	size_t g_count;
+	struct buffer g_targets;
+	struct buffer g_sources;
+	struct buffer g_stems;
+	struct buffer g_oodate;
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	struct buffer g_allsrc;
+	struct buffer g_dedup;
+#endif
+};
+
+static struct group *groups;
+static bool batched;		// Batch-mode rules have been used
+
+/*
+ * Defer an expanded command for a target.
+ */
+static void
+defer(struct name *np, char *q)
+{
+	struct batch *bp;
+	char *s = strrchr(q, ' ');
+
+	if (s == NULL)
+		s = q;
+	for (bp = batches; bp; bp = bp->b_next) {
+		if (strncmp(bp->b_cmd, q, s - q) == 0 && bp->b_cmd[s - q] == '\0')
+			break;
+	}
+	if (bp == NULL) {
+		bp = xmalloc(sizeof(*bp));
+		bp->b_next = NULL;
+		bp->b_target = np;
+		bp->b_cmd = xstrndup(q, s - q);
+		bp->b_args = (struct buffer){NULL, 0, 0};
+		*lastbatch = bp;
+		lastbatch = &bp->b_next;
+	}
+	bufadd(&bp->b_args, s, strlen(s));
+}
+
+/*
+ * Run the deferred commands and return the exit status.
+ */
+static int
+runbatches(void)
+{
+	struct batch *bp;
+	char *cmd;
+	int estat = 0;
+
+	run_gen++;
+	while ((bp = batches)) {
+		batches = bp->b_next;
+		if (batches == NULL)
+			lastbatch = &batches;
+		cmd = xconcat3(bp->b_cmd, bp->b_args.b_str, "");
+		estat |= docmd(bp->b_target, cmd, estat);
+		free(cmd);
+		free(bp->b_cmd);
+		free(bp->b_args.b_str);
+		free(bp);
+	}
+	free(batchlib);
+	batchlib = NULL;
+	return estat;
+}
+#endif
+
+/*
+ * Do commands to make a target
+ */
+static int
+docmds(struct name *np, struct cmd *cp)
+{
+	int estat = 0;
+	char *command;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	capturing = startdeps(np);
+#endif
+	// With -k the commands stop at the first which fails
+	for (; cp && !(estat & MAKE_FAILURE); cp = cp->c_next) {
+		// Location of command in makefile (for use in error messages)
+		makefile = cp->c_makefile;
+		dispno = cp->c_dispno;
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+		opts &= ~OPT_make;	// We want to know if $(MAKE) is expanded
+#endif
+		// Commands are compiled once, however many targets use them
+		if (cp->c_tmpl == NULL)
+			cp->c_tmpl = compile_macros(cp->c_cmd, FALSE, aalloc);
+		command = expand_tmpl(cp->c_tmpl);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// Archive updates are deferred in non-POSIX mode
+		if (!posix && cp->c_archive && getinternal('%')[0]) {
+			if (batchlib == NULL)
+				batchlib = xstrdup(getinternal('@'));
+			defer(np, command);
 			estat = MAKE_DIDSOMETHING;
+		} else
+#endif
+			estat = docmd(np, command, estat);
 		free(command);
 	}
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (capturing)
+		enddeps(np, !(estat & MAKE_FAILURE));
+	capturing = FALSE;
+#endif
 	makefile = NULL;
 	return estat;
 }
@@ -135,41 +405,6 @@ touch(struct name *np)
 	}
 }
 
-#if !ENABLE_FEATURE_MAKE_POSIX_202X
-# define make1(n, c, o, a, d, i) make1(n, c, o, i)
-#endif
-static int
-make1(struct name *np, struct cmd *cp, char *oodate, char *allsrc,
-		char *dedup, struct name *implicit)
-{
-	int estat;
-	char *name, *member = NULL, *base;
-
-	name = splitlib(np->n_name, &member);
-	setmacro("?", oodate, 0 | M_VALID);
-#if ENABLE_FEATURE_MAKE_POSIX_202X
-	if (!POSIX_2017) {
-		setmacro("+", allsrc, 0 | M_VALID);
-		setmacro("^", dedup, 0 | M_VALID);
-	}
-#endif
-	setmacro("%", member, 0 | M_VALID);
-	setmacro("@", name, 0 | M_VALID);
-	if (implicit) {
-		setmacro("<", implicit->n_name, 0 | M_VALID);
-		base = member ? member : name;
-		*suffix(base) = '\0';
-		setmacro("*", base, 0 | M_VALID);
-	}
-	free(name);
-
-	estat = docmds(np, cp);
-	if (dotouch && !(np->n_flag & N_PHONY))
-		touch(np);
-
-	return estat;
-}
-
 /*
  * Determine if the modification time of a target, t, is less than
  * that of a prerequisite, p.  If the tv_nsec member of either is
@@ -197,48 +432,486 @@ timespec_max(const struct timespec *t, const struct timespec *p)
 	return timespec_le(t, p) ? p : t;
 }
 
+#define P_OODATE	0x01	// Prerequisite is out-of-date ($?)
+#define P_DUP		0x02	// Duplicate prerequisite (not in $^)
+#define P_ORDER		0x04	// Order-only prerequisite (not in $?, $+ or $^)
+
+// The prerequisites of a target, in order, from which $?, $+ and $^
+// are constructed if they're used.
+struct prereq {
+	struct name *p_name;
+	uint8_t p_flag;
+};
+
+static struct prereq *prereqs;
+static size_t nprereq, maxprereq;
+
+// Marks used to detect duplicate prerequisites, indexed like namev[]
+static unsigned int *marks;
+static uint32_t maxmark;
+
+// Values of the internal macros for the target being made.  They're
+// only worked out when first used.
+struct internal {
+	struct name *i_target;		// $@, $%
+	struct name *i_implicit;	// $<, $*
+	const char *i_stem;			// $* for a pattern rule
+	char *i_oodate;				// $?
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	char *i_allsrc;				// $+
+	char *i_dedup;				// $^
+#endif
+	char *i_name;				// Target name, without any member
+	char *i_member;				// Archive member or NULL
+	char *i_base;				// Target name without suffix
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct group *i_group;		// Batch of targets being made together
+#endif
+};
+
+static struct internal *internal;
+
 /*
- * Recursive routine to make a target.
+ * Add a name to the list of prerequisites of target np.
  */
-int
-make(struct name *np, int level)
+static void
+addprereq(struct name *np, struct name *dp, unsigned int pass, int order)
 {
-	struct depend *dp;
-	struct rule *rp;
-	struct name *impdep = NULL;	// implicit prerequisite
-	struct rule imprule;
-	struct cmd *sc_cmd = NULL;	// commands for single-colon rule
-	char *oodate = NULL;
+	struct prereq *pp;
+
+	if (nprereq == maxprereq) {
+		maxprereq = MAX(2 * maxprereq, 32);
+		prereqs = xrealloc(prereqs, maxprereq * sizeof(*prereqs));
+	}
+	pp = prereqs + nprereq++;
+	pp->p_name = dp;
+	pp->p_flag = 0;
+	if (order) {
+		pp->p_flag = P_ORDER;
+		return;
+	}
+	if (marks[dp->n_index] == pass)
+		pp->p_flag |= P_DUP;
+	marks[dp->n_index] = pass;
+	if (timespec_le(&np->n_tim, &dp->n_tim)
+			IF_FEATURE_MAKE_EXTENSIONS(&&
+				(posix || !(pp->p_flag & P_DUP))))
+		pp->p_flag |= P_OODATE;
+}
+
+/*
+ * Make a list of the prerequisites in a range of rules, preceded by
+ * those of the inference rule 'imp' if it isn't NULL, noting which
+ * are out-of-date and which are duplicates.  Duplicates are detected
+ * by marking names with a number unique to each call.
+ */
+static void
+getprereqs(struct name *np, struct rule *imp,
+			struct rule *rp, struct rule *stop)
+{
+	static unsigned int pass;
+	uint32_t i;
+
+	if (maxmark < nname) {
+		marks = xrealloc(marks, nname * sizeof(*marks));
+		memset(marks + maxmark, 0, (nname - maxmark) * sizeof(*marks));
+		maxmark = nname;
+	}
+
+	pass++;
+	nprereq = 0;
+	for (i = 0; imp && i < imp->r_ndep; i++)
+		addprereq(np, getdep(imp, i), pass, i >= normaldeps(imp));
+	for (; rp != stop; rp = rp->r_next) {
+		for (i = 0; i < rp->r_ndep; i++)
+			addprereq(np, getdep(rp, i), pass, i >= normaldeps(rp));
+	}
+}
+
+/*
+ * Construct a space-separated list of those prerequisites whose
+ * flags, masked by 'mask', have the value 'want'.
+ */
+static char *
+prereq_list(int mask, int want)
+{
+	struct buffer buf = {NULL, 0, 0};
+	struct prereq *pp;
+
+	for (pp = prereqs; pp < prereqs + nprereq; pp++) {
+		if ((pp->p_flag & mask) == want) {
+			if (buf.b_len)
+				bufadd(&buf, " ", 1);
+			bufadd(&buf, pathname(pp->p_name), strlen(pathname(pp->p_name)));
+		}
+	}
+	return buf.b_str ? buf.b_str : xstrdup("");
+}
+
+/*
+ * Return the value of an internal macro or NULL if no target is
+ * being made.
+ */
+const char *
+getinternal(int c)
+{
+	struct internal *ip = internal;
+
+	if (ip == NULL)
+		return NULL;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// In a batch-mode rule $@, $< and $* are lists
+	if (ip->i_group) {
+		const struct buffer *bp = NULL;
+
+		switch (c) {
+		case '@':
+			bp = &ip->i_group->g_targets;
+			break;
+		case '<':
+			bp = &ip->i_group->g_sources;
+			break;
+		case '*':
+			bp = &ip->i_group->g_stems;
+			break;
+		case '?':
+			bp = &ip->i_group->g_oodate;
+			break;
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+		case '+':
+			if (POSIX_2017)
+				return NULL;
+			bp = &ip->i_group->g_allsrc;
+			break;
+		case '^':
+			if (POSIX_2017)
+				return NULL;
+			bp = &ip->i_group->g_dedup;
+			break;
+#endif
+		}
+		return bp && bp->b_str ? bp->b_str : "";
+	}
+#endif
+
+	if (ip->i_name == NULL && (c == '@' || c == '%' || c == '*'))
+		ip->i_name = splitlib(ip->i_target->n_name, &ip->i_member);
+
+	switch (c) {
+	case '?':
+		if (ip->i_oodate == NULL)
+			ip->i_oodate = prereq_list(P_OODATE, P_OODATE);
+		return ip->i_oodate;
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	case '+':
+		if (POSIX_2017)
+			break;
+		if (ip->i_allsrc == NULL)
+			ip->i_allsrc = prereq_list(P_ORDER, 0);
+		return ip->i_allsrc;
+	case '^':
+		if (POSIX_2017)
+			break;
+		if (ip->i_dedup == NULL)
+			ip->i_dedup = prereq_list(P_DUP | P_ORDER, 0);
+		return ip->i_dedup;
+#endif
+	case '%':
+		return ip->i_member ? ip->i_member : "";
+	case '@':
+		return ip->i_name;
+	case '<':
+		return ip->i_implicit ? pathname(ip->i_implicit) : "";
+	case '*':
+		if (ip->i_implicit == NULL)
+			return "";
+		if (ip->i_stem)
+			return ip->i_stem;
+		if (ip->i_base == NULL) {
+			ip->i_base = xstrdup(ip->i_member ? ip->i_member : ip->i_name);
+			*suffix(ip->i_base) = '\0';
+		}
+		return ip->i_base;
+	}
+	return NULL;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Run the commands for a batch of targets, which has been removed from
+ * the list of batches, and free it.
+ */
+static int
+rungroup(struct group *gp)
+{
+	struct internal in = {0}, *saved = internal;
+	struct name *np;
+	int estat;
+	size_t i;
+
+	in.i_target = gp->g_name[0];
+	in.i_group = gp;
+	internal = &in;
+	run_gen++;
+	estat = docmds(gp->g_name[0], gp->g_cmd);
+	internal = saved;
+
+	// The targets have only now been made
+	for (i = 0; i < gp->g_count; i++) {
+		np = gp->g_name[i];
+		nstate[np->n_index] &= ~S_BATCH;
+		if ((estat & MAKE_FAILURE))
+			nstate[np->n_index] |= S_FAILED;
+		else
+			clock_gettime(CLOCK_REALTIME, &np->n_tim);
+	}
+	free(gp->g_key);
+	free(gp->g_name);
+	free(gp->g_targets.b_str);
+	free(gp->g_sources.b_str);
+	free(gp->g_stems.b_str);
+	free(gp->g_oodate.b_str);
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	free(gp->g_allsrc.b_str);
+	free(gp->g_dedup.b_str);
+#endif
+	free(gp);
+	return estat;
+}
+
+/*
+ * Run the commands for all batches of targets.
+ */
+static int
+rungroups(void)
+{
+	struct group *gp;
+	int estat = 0;
+
+	while ((gp = groups)) {
+		groups = gp->g_next;
+		estat |= rungroup(gp);
+	}
+	return estat;
+}
+
+/*
+ * Add a word, or a list of them, to a space-separated list.
+ */
+static void
+addword(struct buffer *bp, const char *s)
+{
+	if (s == NULL || *s == '\0')
+		return;
+	if (bp->b_len)
+		bufadd(bp, " ", 1);
+	bufadd(bp, s, strlen(s));
+}
+
+/*
+ * Defer making a target which uses a batch-mode inference rule.
+ * Targets are batched if they use the same rule and its commands
+ * expand to the same thing, apart from the internal macros.  The
+ * internal macros for the target must be set up.
+ */
+static int
+addgroup(struct name *np, struct cmd *cp)
+{
+	static struct group nogroup;
+	struct internal *ip = internal;
+	struct buffer key = {NULL, 0, 0};
+	struct group *gp, **gpp;
+	struct cmd *kcp;
+	char *s;
+	int estat = 0;
+	long max;
+
+	batched = TRUE;
+	ip->i_group = &nogroup;
+	for (kcp = cp; kcp; kcp = kcp->c_next) {
+		if (kcp->c_tmpl == NULL)
+			kcp->c_tmpl = compile_macros(kcp->c_cmd, FALSE, aalloc);
+		s = expand_tmpl(kcp->c_tmpl);
+		bufadd(&key, s, strlen(s));
+		bufadd(&key, "\n", 1);
+		free(s);
+	}
+	ip->i_group = NULL;
+
+	for (gpp = &groups; (gp = *gpp); gpp = &gp->g_next) {
+		if (gp->g_cmd == cp && strcmp(gp->g_key, key.b_str) == 0)
+			break;
+	}
+	if (gp == NULL) {
+		gp = xmalloc(sizeof(*gp));
+		memset(gp, 0, sizeof(*gp));
+		gp->g_cmd = cp;
+		gp->g_key = key.b_str;
+		*gpp = gp;
+	} else {
+		free(key.b_str);
+	}
+
+	gp->g_name = xrealloc(gp->g_name, (gp->g_count + 1) * sizeof(*gp->g_name));
+	gp->g_name[gp->g_count++] = np;
+	nstate[np->n_index] |= S_BATCH;
+	addword(&gp->g_targets, getinternal('@'));
+	addword(&gp->g_sources, getinternal('<'));
+	addword(&gp->g_stems, getinternal('*'));
+	addword(&gp->g_oodate, getinternal('?'));
 #if ENABLE_FEATURE_MAKE_POSIX_202X
-	char *allsrc = NULL;
-	char *dedup = NULL;
+	addword(&gp->g_allsrc, getinternal('+'));
+	addword(&gp->g_dedup, getinternal('^'));
 #endif
-	struct timespec dtim = {1, 0};
+
+	// Run the batch if it's reached its maximum size
+	s = expand_macros("$(BATCHSIZE)", FALSE);
+	max = strtol(s, NULL, 10);
+	free(s);
+	if (max > 0 && gp->g_count >= max) {
+		*gpp = gp->g_next;
+		estat |= rungroup(gp);
+	}
+	return estat | MAKE_DIDSOMETHING;
+}
+#endif
+
+/*
+ * Run the commands for a target.  The prerequisites used by the
+ * internal macros must have been found by getprereqs().
+ */
+static int
+make1(struct name *np, struct cmd *cp, struct name *implicit, const char *stem)
+{
 	int estat = 0;
+	struct internal in = {0};
+
+	in.i_target = np;
+	in.i_implicit = implicit;
+	in.i_stem = stem;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// A target found using VPATH is rebuilt in the current directory
+	np->n_path = NULL;
+
+	if (!posix && cp && cp->c_batch && implicit && implicit != np) {
+		internal = &in;
+		estat = addgroup(np, cp);
+		goto done;
+	}
+
+	// Deferred commands are run before anything else, though updates
+	// to an archive can continue while making its members.
+	if (groups)
+		estat = rungroups();
+	if (batches) {
+		char *member = NULL;
+		char *name = splitlib(np->n_name, &member);
+
+		if (!member || strcmp(name, batchlib) != 0)
+			estat |= runbatches();
+		free(name);
+	}
+	// Nothing more is done once deferred commands have failed
+	if ((estat & MAKE_FAILURE))
+		goto done;
+#endif
+
+	internal = &in;
+	run_gen++;
+	estat |= docmds(np, cp);
+ IF_FEATURE_MAKE_EXTENSIONS(done:)
+	internal = NULL;
+	free(in.i_oodate);
+#if ENABLE_FEATURE_MAKE_POSIX_202X
+	free(in.i_allsrc);
+	free(in.i_dedup);
+#endif
+	free(in.i_name);
+	free(in.i_base);
+
+	if (dotouch && !(np->n_flag & N_PHONY))
+		touch(np);
+
+	return estat;
+}
+
+// A target being made.  Frames are kept on an explicit stack, so
+// the depth of the dependency graph isn't limited by the C stack.
+struct frame {
+	struct name *f_name;		// Target
+	struct rule *f_rule;		// Rule whose prerequisites are being made
+	long f_dep;					// Next prerequisite of rule, or F_NEWRULE
+	struct name *f_impdep;		// Implicit prerequisite
+	struct rule f_imprule;		// Inference rule for implicit prerequisite
+	const char *f_stem;			// Stem, if it's a pattern rule
+	struct cmd *f_sccmd;		// Commands for single-colon rule
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct name *f_locdep;		// Implicit prerequisite of current rule
+	bool f_skipped;				// Missing intermediate files were skipped
+	bool f_force;				// Don't skip them
+#endif
+	struct timespec f_dtim;		// Latest time of prerequisites
+	int f_estat;
+	int f_level;
+};
+
+// Before the first prerequisite of a rule.  A double-colon rule using
+// an inference rule has the prerequisites of that rule at negative
+// indices.
+#define F_NEWRULE LONG_MIN
+
+static struct frame *frames;
+static size_t nframe, maxframe;
+
+/*
+ * Start making a target.  If there's work to do push a frame and
+ * return -1, otherwise return the exit status.
+ */
+static int
+make_start(struct name *np, int level)
+{
+	struct name *impdep = NULL;	// implicit prerequisite
+	struct rule imprule;
+	const char *stem = NULL;
+	struct cmd *sc_cmd = NULL;	// commands for single-colon rule
+	struct frame *fp;
 
-	if (np->n_flag & N_DONE)
+	if (nstate[np->n_index] & S_DONE)
 		return 0;
-	if (np->n_flag & N_DOING)
+	if (nstate[np->n_index] & S_DOING)
 		error("circular dependency for %s", np->n_name);
-	np->n_flag |= N_DOING;
+	nstate[np->n_index] |= S_DOING;
 
 	if (!np->n_tim.tv_sec)
 		modtime(np);		// Get modtime of this file
 
+	imprule.r_cmd = NULL;
+	imprule.r_ndep = 0;
 	if (!(np->n_flag & N_DOUBLE)) {
 		// Find the commands needed for a single-colon rule, using
 		// an inference rule or .DEFAULT rule if necessary
 		sc_cmd = getcmd(np);
 		if (!sc_cmd) {
-			impdep = dyndep(np, &imprule);
+			impdep = dyndep(np, &imprule, &stem);
 			if (impdep) {
 				sc_cmd = imprule.r_cmd;
-				addrule(np, imprule.r_dep, NULL, FALSE);
+				addrule(np, imprule.r_dep, imprule.r_ndep, NULL, FALSE);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				np->n_lastrule->r_norder = imprule.r_norder;
+#endif
 			}
 		}
 
 		// As a last resort check for a default rule
 		if (!(np->n_flag & N_TARGET) && np->n_tim.tv_sec == 0) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			// A recorded prerequisite may no longer be needed
+			if ((np->n_flag & N_RECORDED)) {
+				nstate[np->n_index] = S_DONE;
+				return 0;
+			}
+#endif
 			sc_cmd = getcmd(findname(".DEFAULT"));
 			if (!sc_cmd) {
 				if (doinclude)
@@ -250,11 +923,13 @@ make(struct name *np, int level)
 	}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	else {
+		struct rule *rp;
+
 		// If any double-colon rule has no commands we need
 		// an inference rule
 		for (rp = np->n_rule; rp; rp = rp->r_next) {
 			if (!rp->r_cmd) {
-				impdep = dyndep(np, &imprule);
+				impdep = dyndep(np, &imprule, &stem);
 				if (!impdep) {
 					if (doinclude)
 						return 1;
@@ -266,124 +941,425 @@ make(struct name *np, int level)
 	}
 #endif
 
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_202X
-	// Reset flag to detect duplicate prerequisites
-	if (!quest && !(np->n_flag & N_DOUBLE)) {
-		for (rp = np->n_rule; rp; rp = rp->r_next) {
-			for (dp = rp->r_dep; dp; dp = dp->d_next) {
-				dp->d_name->n_flag &= ~N_MARK;
-			}
-		}
+	if (nframe == maxframe) {
+		maxframe = MAX(2 * maxframe, 64);
+		frames = xrealloc(frames, maxframe * sizeof(*frames));
 	}
+	fp = frames + nframe++;
+	fp->f_name = np;
+	fp->f_rule = np->n_rule;
+	fp->f_dep = F_NEWRULE;
+	fp->f_impdep = impdep;
+	fp->f_imprule = imprule;
+	fp->f_stem = stem;
+	fp->f_sccmd = sc_cmd;
+	fp->f_dtim = (struct timespec){1, 0};
+	fp->f_estat = 0;
+	fp->f_level = level;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	fp->f_skipped = fp->f_force = FALSE;
 #endif
+	return -1;
+}
 
-	for (rp = np->n_rule; rp; rp = rp->r_next) {
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-		struct name *locdep = NULL;
+// Intermediate files made by chained inference, to be removed
+static struct name **made;
+static size_t nmade, maxmade;
 
-		// Each double-colon rule is handled separately.
-		if ((np->n_flag & N_DOUBLE)) {
-			// If the rule has no commands use the inference rule.
-			if (!rp->r_cmd) {
-				locdep = impdep;
-				imprule.r_dep->d_next = rp->r_dep;
-				rp->r_dep = imprule.r_dep;
-				rp->r_cmd = imprule.r_cmd;
-			}
-			// A rule with no prerequisities is executed unconditionally.
-			if (!rp->r_dep)
-				dtim = np->n_tim;
-			// Reset flag to detect duplicate prerequisites
-			if (!quest) {
-				for (dp = rp->r_dep; dp; dp = dp->d_next) {
-					dp->d_name->n_flag &= ~N_MARK;
-				}
-			}
-		}
-#endif
-		for (dp = rp->r_dep; dp; dp = dp->d_next) {
-			// Make prerequisite
-			estat |= make(dp->d_name, level + 1);
+/*
+ * Find the latest time of the files from which a missing intermediate
+ * file would be made, following the chain through any intermediate
+ * files which are also missing.  Return FALSE if it can't be found.
+ */
+static int
+chaintime(struct name *np, struct timespec *tp)
+{
+	struct name *dp;
+	struct rule *rp;
+	uint32_t i;
+	int ret = TRUE;
 
-			// Make strings of out-of-date prerequisites (for $?),
-			// all prerequisites (for $+) and deduplicated prerequisites
-			// (for $^).  But not if we were invoked with -q.
-			if (!quest) {
-				if (timespec_le(&np->n_tim, &dp->d_name->n_tim)) {
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-					if (posix || !(dp->d_name->n_flag & N_MARK))
-#endif
-						oodate = xappendword(oodate, dp->d_name->n_name);
-				}
-#if ENABLE_FEATURE_MAKE_POSIX_202X
-				allsrc = xappendword(allsrc, dp->d_name->n_name);
-				if (!(dp->d_name->n_flag & N_MARK))
-					dedup = xappendword(dedup, dp->d_name->n_name);
-#endif
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_202X
-				dp->d_name->n_flag |= N_MARK;
-#endif
-			}
-			dtim = *timespec_max(&dtim, &dp->d_name->n_tim);
-		}
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-		if ((np->n_flag & N_DOUBLE)) {
-			if (!quest && ((np->n_flag & N_PHONY) ||
-							timespec_le(&np->n_tim, &dtim))) {
-				if (!(estat & MAKE_FAILURE)) {
-					estat |= make1(np, rp->r_cmd, oodate, allsrc,
-										dedup, locdep);
-					dtim = (struct timespec){1, 0};
-				}
-				free(oodate);
-				oodate = NULL;
-			}
-#if ENABLE_FEATURE_MAKE_POSIX_202X
-			free(allsrc);
-			free(dedup);
-			allsrc = dedup = NULL;
-#endif
-			if (locdep) {
-				rp->r_dep = rp->r_dep->d_next;
-				rp->r_cmd = NULL;
-			}
+	gettime(np);
+	if (np->n_tim.tv_sec) {
+		*tp = *timespec_max(tp, &np->n_tim);
+		return TRUE;
+	}
+	// A stand-in name is a missing file found by chained inference
+	if ((np->n_flag & N_PROBE))
+		return (dp = dyndep(np, NULL, NULL)) && chaintime(dp, tp);
+	if (!(np->n_flag & N_INTERMEDIATE) || (np->n_flag & N_PHONY) ||
+			nstate[np->n_index])
+		return FALSE;
+
+	nstate[np->n_index] |= S_DOING;
+	for (rp = np->n_rule; rp && ret; rp = rp->r_next) {
+		for (i = 0; i < normaldeps(rp) && ret; i++)
+			ret = chaintime(getdep(rp, i), tp);
+	}
+	if (ret && !getcmd(np))
+		ret = (dp = dyndep(np, NULL, NULL)) && chaintime(dp, tp);
+	nstate[np->n_index] &= ~S_DOING;
+	return ret;
+}
+
+/*
+ * Return TRUE if a missing intermediate file needn't be made for a
+ * target, because the target is newer than the files it comes from.
+ */
+static int
+skipchain(struct name *np, struct name *dp)
+{
+	struct timespec t = {0, 0};
+
+	return !posix && (dp->n_flag & N_INTERMEDIATE) &&
+			!(np->n_flag & (N_DOUBLE | N_PHONY)) && np->n_tim.tv_sec &&
+			!nstate[dp->n_index] && chaintime(dp, &t) &&
+			!dp->n_tim.tv_sec && !timespec_le(&np->n_tim, &t);
+}
+
+/*
+ * Return TRUE if commands to make a prerequisite of a rule have been
+ * deferred.
+ */
+static int
+deferred(struct rule *rp)
+{
+	uint32_t i;
+
+	for (i = 0; i < rp->r_ndep; i++) {
+		if ((nstate[getdep(rp, i)->n_index] & S_BATCH))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Update a frame for prerequisites of a rule which may have been made
+ * by deferred commands since they were looked at.
+ */
+static void
+batchdeps(struct frame *fp, struct rule *rp)
+{
+	struct name *dp;
+	uint32_t i;
+
+	for (i = 0; i < rp->r_ndep; i++) {
+		dp = getdep(rp, i);
+		if ((nstate[dp->n_index] & S_FAILED))
+			fp->f_estat |= MAKE_FAILURE;
+		else if (i < normaldeps(rp))
+			fp->f_dtim = *timespec_max(&fp->f_dtim, &dp->n_tim);
+	}
+}
+
+/*
+ * Before deciding whether the target in a frame is out-of-date run
+ * any deferred commands for the prerequisites of the inference rule
+ * 'imp', if it isn't NULL, and of a range of rules.
+ */
+static void
+waitgroups(struct frame *fp, struct rule *imp, struct rule *rp,
+			struct rule *stop)
+{
+	struct rule *r;
+	int run;
+
+	if (!batched)
+		return;
+
+	run = imp && deferred(imp);
+	for (r = rp; r != stop && !run; r = r->r_next)
+		run = deferred(r);
+	// Failures are found from the state of the prerequisites
+	if (run)
+		rungroups();
+
+	if (imp)
+		batchdeps(fp, imp);
+	for (r = rp; r != stop; r = r->r_next)
+		batchdeps(fp, r);
+}
+
+/*
+ * Remove the intermediate files which have been made, if they're
+ * listed in .INTERMEDIATE or it has no prerequisites, unless they're
+ * secondary or precious.
+ */
+static void
+remove_intermediates(void)
+{
+	struct buffer buf = {NULL, 0, 0};
+	struct name *np;
+	size_t i;
+
+	for (i = 0; i < nmade; i++) {
+		np = made[i];
+		if (!(np->n_flag & N_REMOVE) && !(opts & OPT_intermediate))
+			continue;
+		if ((np->n_flag & (N_SECONDARY | N_PRECIOUS)) ||
+				(opts & (OPT_secondary | OPT_precious)))
+			continue;
+		if (unlink(np->n_name) == 0) {
+			bufadd(&buf, buf.b_len ? " " : "rm -f ", buf.b_len ? 1 : 6);
+			bufadd(&buf, np->n_name, strlen(np->n_name));
 		}
-#endif
 	}
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-	if ((np->n_flag & N_DOUBLE) && impdep)
-		free(imprule.r_dep);
+	if (buf.b_len && !silent)
+		puts(buf.b_str);
+	free(buf.b_str);
+	nmade = 0;
+}
+
+/*
+ * Return TRUE if a target made by the same commands as a grouped
+ * target is older than the target's prerequisites.
+ */
+static int
+groupstale(struct name *np, struct cmd *cp, const struct timespec *dtim)
+{
+	struct name *gp;
+	uint32_t i;
+
+	for (i = 0; cp && i < cp->c_ngroup; i++) {
+		gp = namev[edges[cp->c_group + i]];
+		if (gp == np)
+			continue;
+		if (!gp->n_tim.tv_sec)
+			modtime(gp);
+		if (timespec_le(&gp->n_tim, dtim))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * The commands for a grouped target have been run, so the other
+ * targets in the group have been made too.
+ */
+static void
+groupdone(struct name *np, struct cmd *cp)
+{
+	struct name *gp;
+	uint32_t i;
+
+	for (i = 0; i < cp->c_ngroup; i++) {
+		gp = namev[edges[cp->c_group + i]];
+		if (gp == np || (nstate[gp->n_index] & S_DOING))
+			continue;
+		nstate[gp->n_index] |= S_DONE;
+		gp->n_path = NULL;
+		if (dotouch && !(gp->n_flag & N_PHONY))
+			touch(gp);
+		clock_gettime(CLOCK_REALTIME, &gp->n_tim);
+	}
+}
 #endif
 
-	np->n_flag |= N_DONE;
-	np->n_flag &= ~N_DOING;
+/*
+ * All prerequisites of the target on top of the stack have been
+ * made.  Pop its frame, make it if required and return the exit status.
+ */
+static int
+make_finish(void)
+{
+	struct frame *fp = frames + --nframe;
+	struct name *np = fp->f_name;
+	int estat = fp->f_estat;
+
+	nstate[np->n_index] = (nstate[np->n_index] & ~S_DOING) | S_DONE;
 
 	if (quest) {
-		if (timespec_le(&np->n_tim, &dtim)) {
+		if (timespec_le(&np->n_tim, &fp->f_dtim)
+				IF_FEATURE_MAKE_EXTENSIONS(||
+					groupstale(np, fp->f_sccmd, &fp->f_dtim))) {
 			// MAKE_FAILURE means rebuild is needed
 			estat = MAKE_FAILURE | MAKE_DIDSOMETHING;
 		}
 	} else if (!(np->n_flag & N_DOUBLE) &&
-				((np->n_flag & N_PHONY) || (timespec_le(&np->n_tim, &dtim)))) {
+				((np->n_flag & N_PHONY) || (timespec_le(&np->n_tim, &fp->f_dtim))
+				IF_FEATURE_MAKE_EXTENSIONS(||
+					groupstale(np, fp->f_sccmd, &fp->f_dtim)))) {
 		if (!(estat & MAKE_FAILURE)) {
-			if (sc_cmd)
-				estat |= make1(np, sc_cmd, oodate, allsrc, dedup, impdep);
-			else if (!doinclude && level == 0 && !(estat & MAKE_DIDSOMETHING))
+			if (fp->f_sccmd) {
+				getprereqs(np, NULL, np->n_rule, NULL);
+				estat |= make1(np, fp->f_sccmd, fp->f_impdep, fp->f_stem);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				if ((estat & (MAKE_DIDSOMETHING | MAKE_FAILURE)) ==
+						MAKE_DIDSOMETHING)
+					groupdone(np, fp->f_sccmd);
+#endif
+			} else if (!doinclude && fp->f_level == 0 &&
+						!(estat & MAKE_DIDSOMETHING))
 				warning("nothing to be done for %s", np->n_name);
 		} else if (!doinclude) {
 			warning("'%s' not built due to errors", np->n_name);
 		}
-		free(oodate);
 	}
 
-	if (estat & MAKE_DIDSOMETHING)
-		clock_gettime(CLOCK_REALTIME, &np->n_tim);
-	else if (!quest && level == 0 && !timespec_le(&np->n_tim, &dtim))
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// Note intermediate files which didn't exist before being made
+	if ((np->n_flag & N_INTERMEDIATE) && !np->n_tim.tv_sec && !posix &&
+			(estat & (MAKE_DIDSOMETHING | MAKE_FAILURE)) == MAKE_DIDSOMETHING &&
+			!quest && !dryrun && !dotouch) {
+		if (nmade == maxmade) {
+			maxmade = MAX(2 * maxmade, 16);
+			made = xrealloc(made, maxmade * sizeof(*made));
+		}
+		made[nmade++] = np;
+	}
+#endif
+	if (estat & MAKE_DIDSOMETHING) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// A deferred target's time is set when it's made
+		if (!(nstate[np->n_index] & S_BATCH))
+#endif
+			clock_gettime(CLOCK_REALTIME, &np->n_tim);
+	} else if (!quest && fp->f_level == 0 && !timespec_le(&np->n_tim, &fp->f_dtim))
 		printf("%s: '%s' is up to date\n", myname, np->n_name);
 
-#if ENABLE_FEATURE_MAKE_POSIX_202X
-	free(allsrc);
-	free(dedup);
-#endif
 	return estat;
 }
+
+/*
+ * A prerequisite of the target in a frame has been made.  Unless it's
+ * order-only, its time and whether it was rebuilt affect the target.
+ */
+static void
+newer(struct frame *fp, struct name *dp, int estat)
+{
+	// The prerequisite is the nth of its rule, or of the inference
+	// rule of a double-colon rule if the index is negative.
+	struct rule *rp = fp->f_dep > 0 ? fp->f_rule : &fp->f_imprule;
+	long n = fp->f_dep > 0 ? fp->f_dep : fp->f_imprule.r_ndep + fp->f_dep;
+
+	if (n > (long)normaldeps(rp)) {
+		fp->f_estat |= estat & MAKE_FAILURE;
+		return;
+	}
+	fp->f_estat |= estat;
+	fp->f_dtim = *timespec_max(&fp->f_dtim, &dp->n_tim);
+}
+
+/*
+ * Make a target.  Prerequisites are made depth-first, in order, by
+ * pushing a frame for each target which needs to be looked at.
+ */
+int
+make(struct name *np, int level)
+{
+	size_t base = nframe;
+	struct frame *fp;
+	struct rule *rp;
+	struct name *dp;
+	int estat;
+
+	if ((estat = make_start(np, level)) >= 0)
+		return estat;
+
+	for (;;) {
+		// The stack may have moved, so always refetch the top
+		fp = frames + nframe - 1;
+		rp = fp->f_rule;
+		np = fp->f_name;
+
+		if (rp == NULL) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (!(np->n_flag & N_DOUBLE))
+				waitgroups(fp, NULL, np->n_rule, NULL);
+
+			// If the target is out-of-date after all go back and
+			// make any intermediate files which were skipped.
+			if (fp->f_skipped && !fp->f_force &&
+					!(fp->f_estat & MAKE_FAILURE) &&
+					(timespec_le(&np->n_tim, &fp->f_dtim) ||
+					groupstale(np, fp->f_sccmd, &fp->f_dtim))) {
+				fp->f_force = TRUE;
+				fp->f_rule = np->n_rule;
+				fp->f_dep = F_NEWRULE;
+				continue;
+			}
+#endif
+			// All rules done: finish the target and pass the
+			// result to the target that needed it, if any.
+			dp = np;
+			estat = make_finish();
+			if (nframe == base) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				if (base == 0 && groups)
+					estat |= rungroups();
+				if (base == 0 && batches)
+					estat |= runbatches();
+				if (base == 0 && nmade)
+					remove_intermediates();
+#endif
+				return estat;
+			}
+			fp = frames + nframe - 1;
+			newer(fp, dp, estat);
+			continue;
+		}
+
+		if (fp->f_dep == F_NEWRULE) {
+			fp->f_dep = 0;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			fp->f_locdep = NULL;
+
+			// Each double-colon rule is handled separately.
+			if ((np->n_flag & N_DOUBLE)) {
+				// If the rule has no commands use the inference rule,
+				// whose prerequisites come first.
+				if (!rp->r_cmd) {
+					fp->f_locdep = fp->f_impdep;
+					fp->f_dep = -(long)fp->f_imprule.r_ndep;
+				}
+				// A rule with no prerequisities is executed unconditionally.
+				else if (rp->r_ndep == 0)
+					fp->f_dtim = np->n_tim;
+			}
+#endif
+		}
+
+		if (fp->f_dep < (long)rp->r_ndep) {
+			// Make prerequisite
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (fp->f_dep < 0)
+				dp = getdep(&fp->f_imprule, fp->f_imprule.r_ndep + fp->f_dep);
+			else
+#endif
+				dp = getdep(rp, fp->f_dep);
+			fp->f_dep++;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (!fp->f_force && skipchain(np, dp)) {
+				fp->f_skipped = TRUE;
+				continue;
+			}
+#endif
+			if ((estat = make_start(dp, fp->f_level + 1)) >= 0)
+				newer(frames + nframe - 1, dp, estat);
+			continue;
+		}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if ((np->n_flag & N_DOUBLE)) {
+			waitgroups(fp, fp->f_locdep ? &fp->f_imprule : NULL,
+						rp, rp->r_next);
+			if (!quest && ((np->n_flag & N_PHONY) ||
+							timespec_le(&np->n_tim, &fp->f_dtim))) {
+				if (!(fp->f_estat & MAKE_FAILURE)) {
+					struct name *locdep = fp->f_locdep;
+
+					getprereqs(np, locdep ? &fp->f_imprule : NULL,
+								rp, rp->r_next);
+					fp->f_estat |= make1(np,
+									locdep ? fp->f_imprule.r_cmd : rp->r_cmd,
+									locdep, locdep ? fp->f_stem : NULL);
+					fp->f_dtim = (struct timespec){1, 0};
+				}
+			}
+		}
+#endif
+		fp->f_rule = rp->r_next;
+		fp->f_dep = F_NEWRULE;
+	}
+}
@@ -122,6 +122,10 @@ enum {
 	IF_FEATURE_MAKE_POSIX_202X(OPTBIT_phony,)
 	IF_FEATURE_MAKE_POSIX_202X(OPTBIT_include,)
 	IF_FEATURE_MAKE_POSIX_202X(OPTBIT_make,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_showinc,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_trace,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_secondary,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_intermediate,)
 
 	OPT_e = (1 << OPTBIT_e),
 	OPT_i = (1 << OPTBIT_i),
@@ -143,6 +147,10 @@ enum {
 	OPT_phony = IF_FEATURE_MAKE_POSIX_202X((1 << OPTBIT_phony)) + 0,
 	OPT_include = IF_FEATURE_MAKE_POSIX_202X((1 << OPTBIT_include)) + 0,
 	OPT_make = IF_FEATURE_MAKE_POSIX_202X((1 << OPTBIT_make)) + 0,
+	OPT_showinc = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_showinc)) + 0,
+	OPT_trace = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_trace)) + 0,
+	OPT_secondary = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_secondary)) + 0,
+	OPT_intermediate = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_intermediate)) + 0,
 };
 
 // Options in OPTSTR1 that aren't included in MAKEFLAGS
@@ -163,15 +171,25 @@ enum {
 
 // A name.  This represents a file, either to be made, or pre-existing.
 struct name {
-	struct name *n_next;	// Next in the list of names
-	char *n_name;			// Called
+	const char *n_name;		// Called (interned)
 	struct rule *n_rule;	// Rules to build this (prerequisites/commands)
+	struct rule *n_lastrule;	// Last rule in list
 	struct timespec n_tim;	// Modification time of this name
 	uint16_t n_flag;		// Info about the name
+	uint32_t n_index;		// Position in namev[]
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	const char *n_path;		// Path found by VPATH search, or NULL
+#endif
 };
 
-#define N_DOING		0x01	// Name in process of being built
-#define N_DONE		0x02	// Name looked at
+// State of a name during traversal, in nstate[] indexed by n_index
+#define S_DOING		0x01	// Name in process of being built
+#define S_DONE		0x02	// Name looked at
+#define S_BATCH		0x04	// Commands to make name have been deferred
+#define S_FAILED	0x08	// Deferred commands to make name failed
+
+#define N_PROBE		0x01	// Candidate prerequisite, not in name table
+#define N_SUFFIX	0x02	// Name is a prerequisite of .SUFFIXES
 #define N_TARGET	0x04	// Name is a target
 #define N_PRECIOUS	0x08	// Target is precious
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -182,45 +200,91 @@ struct name {
 #define N_SILENT	0x20	// Build target silently
 #define N_IGNORE	0x40	// Ignore build errors
 #define N_SPECIAL	0x80	// Special target
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_202X
-#define N_MARK		0x100	// Mark for deduplication
-#endif
 #if ENABLE_FEATURE_MAKE_POSIX_202X
 #define N_PHONY		0x200	// Name is a phony target
 #else
 #define N_PHONY		0		// No support for phony targets
 #endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+#define N_VPATH		0x100	// Name has been found using VPATH
+#define N_SHOWINC	0x400	// Capture included files from commands
+#define N_TRACE		0x800	// Trace files opened by commands
+#define N_INTERMEDIATE	0x1000	// Intermediate file of an inference chain
+#define N_SECONDARY	0x2000	// Intermediate file which isn't removed
+#define N_RECORDED	0x4000	// Prerequisite recorded in the dependency file
+#define N_REMOVE	0x8000	// Intermediate file to be removed after use
+#endif
+
+// The path to use for a name in commands
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+# define pathname(np) ((np)->n_path ? (np)->n_path : (np)->n_name)
+#else
+# define pathname(np) ((np)->n_name)
+#endif
 
-// List of rules to build a target
+// List of rules to build a target.  The prerequisites of a rule are
+// a range of edges[], which holds indices into namev[].  Rules for
+// the targets of a single makefile line share the same range.  Any
+// order-only prerequisites come at the end of the range.
 struct rule {
 	struct rule *r_next;	// Next rule
-	struct depend *r_dep;	// Prerequisites for this rule
 	struct cmd *r_cmd;		// Commands for this rule
+	uint32_t r_dep;			// First prerequisite in edges[]
+	uint32_t r_ndep;		// Number of prerequisites
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	uint32_t r_norder;		// Number of them which are order-only
+#endif
 };
 
-// NOTE: the layout of the following two structures must be compatible.
+// The number of prerequisites of a rule which aren't order-only
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+# define normaldeps(rp) ((rp)->r_ndep - (rp)->r_norder)
+#else
+# define normaldeps(rp) ((rp)->r_ndep)
+#endif
 
-// List of prerequisites for a rule
-struct depend {
-	struct depend *d_next;	// Next prerequisite
-	struct name *d_name;	// Name of prerequisite
-	int d_refcnt;			// Reference count
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// A pattern rule, 'prefix%suffix: prerequisites'
+struct prule {
+	struct prule *pr_next;	// Next in order of definition
+	const char *pr_target;	// Target pattern (interned)
+	size_t pr_plen;			// Length of prefix before '%'
+	size_t pr_slen;			// Length of suffix after '%'
+	bool pr_nodir;			// Target pattern has no '/'
+	unsigned int pr_order;	// Order of definition
+	struct rule pr_rule;	// Prerequisite patterns and commands
 };
 
+extern struct prule *prules;
+#endif
+
+// The i'th prerequisite of a rule
+#define getdep(rp, i) (namev[edges[(rp)->r_dep + (i)]])
+
 // List of commands for a rule
 struct cmd {
 	struct cmd *c_next;		// Next command line
-	char *c_cmd;			// Text of command line
-	int c_refcnt;			// Reference count
-	const char *c_makefile;	// Makefile in which command was defined
+	const char *c_cmd;		// Text of command line (interned)
+	const char *c_makefile;	// Makefile in which command was defined (interned)
 	int c_dispno;			// Line number within makefile
+	struct tmpl *c_tmpl;	// Compiled form of command line
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	bool c_batch;			// Command of a batch-mode inference rule
+	bool c_archive;			// Archive update by a built-in rule
+	uint32_t c_group;		// Grouped targets made by the commands,
+	uint32_t c_ngroup;		// a range of edges[], in the first command
+#endif
 };
 
 // Macro storage
 struct macro {
-	struct macro *m_next;	// Next variable
 	char *m_name;			// Its name
 	char *m_val;			// Its value
+	struct tmpl *m_tmpl;	// Compiled form of value
+	char *m_cache;			// Cached expansion of value
+	unsigned int m_cgen;	// Value of macro_gen when cache was made
+	uint32_t m_cmake;		// Expansion of value refers to $(MAKE)
+	uint8_t m_cmode;		// Mode in which cache was made
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_202X
 	bool m_immediate;		// Immediate-expansion macro set using ::=
 #endif
@@ -234,11 +298,29 @@ struct file {
 	char *f_name;
 };
 
+// Growable string buffer, always NUL-terminated once used
+struct buffer {
+	char *b_str;
+	size_t b_len;
+	size_t b_size;
+};
+
 // Flags passed to setmacro()
 #define M_IMMEDIATE  8		// immediate-expansion macro is being defined
 #define M_VALID     16		// assert macro name is valid
 
-#define HTABSIZE 199
+// Hash table using open addressing.  The table is grown as required.
+struct htab {
+	struct hslot *h_slot;	// Array of slots, empty if h_data is NULL
+	unsigned int h_size;	// Number of slots, a power of two
+	unsigned int h_count;	// Number of slots in use
+};
+
+struct hslot {
+	uint32_t h_hash;		// Full hash of key
+	const char *h_key;
+	void *h_data;
+};
 
 // Constants for PRAGMA.  Order must match strings in set_pragma().
 #define P_MACRO_NAME			0x01
@@ -253,8 +335,16 @@ struct file {
 
 extern const char *myname;
 extern const char *makefile;
-extern struct name *namehead[HTABSIZE];
-extern struct macro *macrohead[HTABSIZE];
+extern struct htab nametab;
+extern struct name **namev;
+extern uint8_t *nstate;
+extern uint32_t nname;
+extern uint32_t *edges;
+extern uint32_t nedge;
+extern struct htab macrotab;
+extern unsigned int macro_gen;
+extern unsigned int suffix_gen;
+extern unsigned int run_gen;
 extern struct name *firstname;
 extern struct name *target;
 extern uint32_t opts;
@@ -269,38 +359,68 @@ extern char *numjobs;
 extern unsigned char pragma;
 #endif
 
+// Return TRUE if name is that of an internal macro, such as $@
+#define isinternal(name) \
+		((name)[0] && (name)[1] == '\0' && strchr("@%?<*^+", (name)[0]))
+
 // Return TRUE if c is allowed in a POSIX 2017 macro or target name
 #define ispname(c) (isalpha(c) || isdigit(c) || c == '.' || c == '_')
 // Return TRUE if c is in the POSIX 'portable filename character set'
 #define isfname(c) (ispname(c) || c == '-')
 
 void print_details(void);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void dbrule(struct name *np, uint32_t dep, uint32_t ndep);
+void loaddeps(void);
+int startdeps(struct name *np);
+int capture(const char *cmd);
+void enddeps(struct name *np, int ok);
+int readdeps(const char *file, int db);
+#endif
 #if !ENABLE_FEATURE_MAKE_POSIX_202X
 #define expand_macros(s, e) expand_macros(s)
+#define compile_macros(s, e, a) compile_macros(s, a)
 #endif
 char *expand_macros(const char *str, int except_dollar);
+struct tmpl *compile_macros(const char *str, int except_dollar,
+		void *(*alloc)(size_t));
+char *expand_tmpl(const struct tmpl *tp);
 void input(FILE *fd, int ilevel);
 struct macro *getmp(const char *name);
 void setmacro(const char *name, const char *val, int level);
 void freemacros(void);
 void remove_target(void);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void unlink_responses(void);
+#endif
+const char *getinternal(int c);
 int make(struct name *np, int level);
 char *splitlib(const char *name, char **member);
 void modtime(struct name *np);
+void freearchives(void);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void setvpath(const char *pattern, char *dirs);
+void freevpath(void);
+#endif
 char *suffix(const char *name);
-struct name *dyndep(struct name *np, struct rule *imprule);
+void gettime(struct name *np);
+struct name *dyndep(struct name *np, struct rule *imprule, const char **stemp);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void addpattern(const char *target, uint32_t dep, uint32_t ndep, uint32_t norder,
+		struct cmd *cp);
+void mark_arcmds(void);
+#endif
+void freesuffrules(void);
 char *getrules(char *s, int size);
 struct name *findname(const char *name);
 struct name *newname(const char *name);
 struct cmd *getcmd(struct name *np);
 void freenames(void);
-struct depend *newdep(struct name *np, struct depend *dp);
-void freedeps(struct depend *dp);
-struct cmd *newcmd(char *str, struct cmd *cp);
-void freecmds(struct cmd *cp);
-void freerules(struct rule *rp);
+void newdep(struct name *np);
+struct cmd **newcmd(char *str, struct cmd **cpp);
 void set_pragma(const char *name);
-void addrule(struct name *np, struct depend *dp, struct cmd *cp, int flag);
+void addrule(struct name *np, uint32_t dep, uint32_t ndep, struct cmd *cp,
+		int flag);
 void diagnostic(const char *msg, ...);
 void error(const char *msg, ...) NORETURN;
 void error_unexpected(const char *s) NORETURN;
@@ -312,7 +432,13 @@ char *xconcat3(const char *s1, const char *s2, const char *s3);
 char *xstrdup(const char *s);
 char *xstrndup(const char *s, size_t n);
 char *xappendword(const char *str, const char *word);
-unsigned int getbucket(const char *name);
-struct file *newfile(char *str, struct file *fphead);
+void bufadd(struct buffer *bp, const char *s, size_t len);
+uint32_t strhash(const char *s);
+void *hfind(const struct htab *tp, const char *key);
+void hinsert(struct htab *tp, const char *key, void *data);
+void *aalloc(size_t len);
+const char *intern(const char *s);
+void freearena(void);
+struct file **newfile(char *str, struct file **fpp);
 void freefiles(struct file *fp);
 int is_valid_target(const char *name);
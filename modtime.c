@@ -3,6 +3,10 @@
  */
 #include "make.h"
 #include <ar.h>
+#include <sys/mman.h>
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+#include <dirent.h>
+#endif
 
 /*
  * Read a number from an archive header.
@@ -24,97 +28,158 @@ argetnum(const char *str, int len)
 	return val;
 }
 
+// The members of an archive, read once and then again only if the
+// archive changes.
+struct archive {
+	struct timespec a_tim;	// Modification time when read
+	unsigned int a_gen;		// Value of run_gen when last checked
+	struct htab a_member;	// Member name to timestamp
+};
+
+static struct htab artab;
+
 /*
- * Search an archive for the given member and return its timestamp or 0.
+ * Add the members of an archive, mapped into memory, to its index.
  * This code assumes System V/GNU archive format.
  */
-static time_t
-arsearch(FILE *fd, const char *member)
+static void
+arindex(struct archive *ap, const char *buf, size_t size)
 {
-	struct ar_hdr hdr;
-	char *s, *t, *names = NULL;
-	size_t len, offset, max_offset = 0;
-	time_t mtime = 0;
-
-	do {
- top:
-		len = fread(&hdr, 1, sizeof(hdr), fd);
-		if (len < sizeof(hdr) ||
-				memcmp(hdr.ar_fmag, ARFMAG, sizeof(hdr.ar_fmag)) != 0) {
-			if (feof(fd))
-				break;
+	const struct ar_hdr *hdr;
+	const char *s, *t, *names = NULL;
+	size_t len, offset, pos, max_offset = 0;
+	time_t *mtime;
+	char *member;
+
+	for (pos = SARMAG; pos < size; pos += len) {
+		hdr = (const struct ar_hdr *)(buf + pos);
+		if (size - pos < sizeof(*hdr) ||
+				memcmp(hdr->ar_fmag, ARFMAG, sizeof(hdr->ar_fmag)) != 0)
 			error("invalid archive");
-		}
+		pos += sizeof(*hdr);
 
 		// Get length of this member.  Length in the file is padded
 		// to an even number of bytes.
-		len = argetnum(hdr.ar_size, sizeof(hdr.ar_size));
+		len = argetnum(hdr->ar_size, sizeof(hdr->ar_size));
 		if (len % 2 == 1)
 			len++;
+		if (len > size - pos)
+			len = size - pos;
 
-		t = hdr.ar_name;
-		if (hdr.ar_name[0] == '/') {
-			if (hdr.ar_name[1] == ' ') {
+		t = hdr->ar_name;
+		s = t + sizeof(hdr->ar_name);
+		if (hdr->ar_name[0] == '/') {
+			if (hdr->ar_name[1] == ' ') {
 				// Skip symbol table
 				continue;
-			} else if (hdr.ar_name[1] == '/' && names == NULL) {
-				// Save list of extended filenames for later use
-				names = xmalloc(len);
-				if (fread(names, 1, len, fd) != len)
-					error("invalid archive");
-				// Replace newline separators with NUL
-				for (s = names; s < names + len; s++) {
-					if (*s == '\n')
-						*s = '\0';
-				}
+			} else if (hdr->ar_name[1] == '/' && names == NULL) {
+				// Save list of extended filenames for later use.
+				// Names are terminated by '/' and a newline.
+				names = buf + pos;
 				max_offset = len;
-				goto top;
-			} else if (isdigit(hdr.ar_name[1]) && names) {
+				continue;
+			} else if (isdigit(hdr->ar_name[1]) && names) {
 				// An extended filename, get its offset in the names list
-				offset = argetnum(hdr.ar_name + 1, sizeof(hdr.ar_name) - 1);
+				offset = argetnum(hdr->ar_name + 1, sizeof(hdr->ar_name) - 1);
 				if (offset > max_offset)
 					error("invalid archive");
 				t = names + offset;
+				s = names + max_offset;
 			} else {
 				error("invalid archive");
 			}
 		}
 
-		s = strchr(t, '/');
+		s = memchr(t, '/', s - t);
 		if (s == NULL)
 			error("invalid archive");
-		*s = '\0';
 
-		if (strcmp(t, member) == 0) {
-			mtime = argetnum(hdr.ar_date, sizeof(hdr.ar_date));
-			break;
+		// The first member with a given name is the one that counts
+		member = xstrndup(t, s - t);
+		if (hfind(&ap->a_member, member) == NULL) {
+			mtime = aalloc(sizeof(*mtime));
+			*mtime = argetnum(hdr->ar_date, sizeof(hdr->ar_date));
+			hinsert(&ap->a_member, strcpy(aalloc(s - t + 1), member), mtime);
 		}
-	} while (fseek(fd, len, SEEK_CUR) == 0);
-	free(names);
-	return mtime;
+		free(member);
+	}
 }
 
+/*
+ * Return the timestamp of an archive member or 0.  The archive is
+ * indexed when first used and, after any commands have been run,
+ * indexed again if its modification time has changed.
+ */
 static time_t
 artime(const char *archive, const char *member)
 {
-	FILE *fd;
-	char magic[SARMAG];
-	size_t len;
-	time_t mtime;
+	struct archive *ap = hfind(&artab, archive);
+	struct stat info;
+	time_t *mtime;
+	void *buf;
+	int fd;
+
+	if (ap && ap->a_gen == run_gen)
+		goto found;
 
-	fd = fopen(archive, "r");
-	if (fd == NULL)
+	if (stat(archive, &info) < 0) {
+		if (ap)
+			ap->a_tim = (struct timespec){0, 0};
 		return 0;
+	}
+	if (ap == NULL) {
+		ap = aalloc(sizeof(*ap));
+		memset(ap, 0, sizeof(*ap));
+		hinsert(&artab, intern(archive), ap);
+	} else if (ap->a_tim.tv_sec == info.st_mtim.tv_sec &&
+				ap->a_tim.tv_nsec == info.st_mtim.tv_nsec) {
+		ap->a_gen = run_gen;
+		goto found;
+	}
+
+	// Start again with an empty index.  Entries from the old one are
+	// left in the arena.
+	free(ap->a_member.h_slot);
+	memset(&ap->a_member, 0, sizeof(ap->a_member));
+	ap->a_tim = (struct timespec){0, 0};
+	ap->a_gen = run_gen;
 
-	len = fread(magic, 1, sizeof(magic), fd);
-	if (len < sizeof(magic) || memcmp(magic, ARMAG, SARMAG) != 0)
+	if ((fd = open(archive, O_RDONLY)) < 0)
+		return 0;
+	if (info.st_size < SARMAG)
+		error("%s: not an archive", archive);
+	buf = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		error("can't read %s: %s", archive, strerror(errno));
+	if (memcmp(buf, ARMAG, SARMAG) != 0)
 		error("%s: not an archive", archive);
+	arindex(ap, buf, info.st_size);
+	munmap(buf, info.st_size);
+	ap->a_tim = info.st_mtim;
 
-	mtime = arsearch(fd, member);
-	fclose(fd);
-	return mtime;
+ found:
+	if (ap->a_tim.tv_sec == 0 && ap->a_tim.tv_nsec == 0)
+		return 0;
+	mtime = hfind(&ap->a_member, member);
+	return mtime ? *mtime : 0;
 }
 
+#if ENABLE_FEATURE_CLEAN_UP
+void
+freearchives(void)
+{
+	unsigned int i;
+	struct archive *ap;
+
+	for (i = 0; i < artab.h_size; i++) {
+		if ((ap = artab.h_slot[i].h_data))
+			free(ap->a_member.h_slot);
+	}
+	free(artab.h_slot);
+}
+#endif
+
 /*
  * If the name is of the form 'libname(member.o)' split it into its
  * name and member parts and set the member pointer to point to the
@@ -144,6 +209,216 @@ splitlib(const char *name, char **member)
 	return t;
 }
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// Directories to search for files which aren't found relative to the
+// current directory, from 'vpath' directives and the VPATH macro.
+struct vpath {
+	struct vpath *v_next;
+	const char *v_pattern;	// Pattern for names, NULL for VPATH
+	const char **v_dir;		// NULL-terminated list of directories
+};
+
+static struct vpath *vpaths, **lastvpath = &vpaths;
+static struct vpath vpathmac;		// Directories from VPATH
+static unsigned int vpathmac_gen;	// Value of macro_gen for vpathmac
+
+// The contents of each directory searched, read when first needed
+// and again if the directory has changed after commands have run.
+struct dir {
+	struct htab d_files;	// Set of file names
+	struct timespec d_mtim;	// Modification time of directory when read
+	time_t d_read;			// Time when read
+	unsigned int d_gen;		// Value of run_gen when checked
+};
+
+static struct htab dirtab;
+
+/*
+ * Split a list of directories separated by whitespace or colons into
+ * an array of interned strings.
+ */
+static const char **
+splitdirs(char *s)
+{
+	const char **dirs = NULL;
+	size_t n = 0;
+	char *p;
+
+	for (p = strtok(s, ": \t\n"); p; p = strtok(NULL, ": \t\n")) {
+		dirs = xrealloc(dirs, (n + 2) * sizeof(*dirs));
+		dirs[n++] = intern(p);
+	}
+	if (dirs)
+		dirs[n] = NULL;
+	return dirs;
+}
+
+/*
+ * Process a 'vpath' directive.  With a pattern and directories add
+ * them to the search path.  With just a pattern remove the entries
+ * for that pattern.  With neither remove all entries.
+ */
+void
+setvpath(const char *pattern, char *dirs)
+{
+	struct vpath *vp, **vpp;
+
+	for (vpp = &vpaths; (vp = *vpp); ) {
+		if (!pattern || (!dirs && strcmp(vp->v_pattern, pattern) == 0)) {
+			*vpp = vp->v_next;
+			free(vp->v_dir);
+			free(vp);
+		} else {
+			vpp = &vp->v_next;
+		}
+	}
+	lastvpath = vpp;
+
+	if (pattern && dirs) {
+		vp = xmalloc(sizeof(*vp));
+		vp->v_next = NULL;
+		vp->v_pattern = intern(pattern);
+		vp->v_dir = splitdirs(dirs);
+		*lastvpath = vp;
+		lastvpath = &vp->v_next;
+	}
+}
+
+/*
+ * Match a name to a vpath pattern, in which '%' matches any string.
+ */
+static int
+vmatch(const char *pattern, const char *name)
+{
+	const char *s = strchr(pattern, '%');
+	size_t plen, slen, len;
+
+	if (s == NULL)
+		return strcmp(pattern, name) == 0;
+	plen = s - pattern;
+	slen = strlen(s + 1);
+	len = strlen(name);
+	return len >= plen + slen && strncmp(name, pattern, plen) == 0 &&
+				strcmp(name + len - slen, s + 1) == 0;
+}
+
+/*
+ * Return TRUE if a file exists, using the cached contents of the
+ * directory it would be in.  After commands have run the directory
+ * is only read again if it's been modified since.
+ */
+static int
+dirhas(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *dir = xstrndup(path, base - path);
+	struct dir *dp = hfind(&dirtab, dir);
+	struct stat info;
+
+	if (dp == NULL) {
+		dp = aalloc(sizeof(*dp));
+		memset(dp, 0, sizeof(*dp));
+		dp->d_gen = run_gen - 1;
+		dp->d_read = -1;
+		hinsert(&dirtab, intern(dir), dp);
+	}
+	if (dp->d_gen != run_gen) {
+		dp->d_gen = run_gen;
+		if (stat(dir, &info) < 0)
+			info.st_mtim = (struct timespec){0, 0};
+		// A change in the second the directory was read may not
+		// have altered its time
+		if (info.st_mtim.tv_sec != dp->d_mtim.tv_sec ||
+				info.st_mtim.tv_nsec != dp->d_mtim.tv_nsec ||
+				info.st_mtim.tv_sec >= dp->d_read) {
+			DIR *d;
+			struct dirent *de;
+
+			free(dp->d_files.h_slot);
+			dp->d_files = (struct htab){NULL, 0, 0};
+			dp->d_mtim = info.st_mtim;
+			dp->d_read = time(NULL);
+			if ((d = opendir(dir)) != NULL) {
+				while ((de = readdir(d)) != NULL) {
+					const char *s = intern(de->d_name);
+					hinsert(&dp->d_files, s, (void *)s);
+				}
+				closedir(d);
+			}
+		}
+	}
+	free(dir);
+	return hfind(&dp->d_files, base + 1) != NULL;
+}
+
+/*
+ * Look for a file in a list of directories.  Return its interned
+ * path or NULL.
+ */
+static const char *
+searchdirs(const char **dir, const char *name)
+{
+	const char *path = NULL;
+	char *s;
+
+	for (; dir && *dir && !path; dir++) {
+		s = xconcat3(*dir, "/", name);
+		if (dirhas(s))
+			path = intern(s);
+		free(s);
+	}
+	return path;
+}
+
+/*
+ * Search for a file which doesn't exist in the current directory
+ * using the vpath directives, then the VPATH macro.
+ */
+static const char *
+vpath_search(const char *name)
+{
+	struct vpath *vp;
+	struct macro *mp;
+	const char *path;
+
+	for (vp = vpaths; vp; vp = vp->v_next) {
+		if (vmatch(vp->v_pattern, name) &&
+				(path = searchdirs(vp->v_dir, name)))
+			return path;
+	}
+
+	// Only split VPATH again if macros have changed
+	if (vpathmac_gen != macro_gen) {
+		free(vpathmac.v_dir);
+		vpathmac.v_dir = NULL;
+		if ((mp = getmp("VPATH")) != NULL) {
+			char *s = expand_macros(mp->m_val, FALSE);
+			vpathmac.v_dir = splitdirs(s);
+			free(s);
+		}
+		vpathmac_gen = macro_gen;
+	}
+	return searchdirs(vpathmac.v_dir, name);
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+freevpath(void)
+{
+	unsigned int i;
+	struct dir *dp;
+
+	setvpath(NULL, NULL);
+	free(vpathmac.v_dir);
+	for (i = 0; i < dirtab.h_size; i++) {
+		if ((dp = dirtab.h_slot[i].h_data))
+			free(dp->d_files.h_slot);
+	}
+	free(dirtab.h_slot);
+}
+#endif
+#endif
+
 /*
  * Get the modification time of a file.  Set it to 0 if the file
  * doesn't exist.
@@ -164,6 +439,18 @@ modtime(struct name *np)
 			error("can't open %s: %s", name, strerror(errno));
 		np->n_tim.tv_sec = 0;
 		np->n_tim.tv_nsec = 0;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// Search other directories until the name is found there
+		if (!posix && *name != '/' && !(np->n_flag & (N_VPATH | N_PHONY))) {
+			np->n_path = vpath_search(name);
+			if (np->n_path)
+				np->n_flag |= N_VPATH;
+		}
+		if (np->n_path && stat(np->n_path, &info) == 0) {
+			np->n_tim.tv_sec = info.st_mtim.tv_sec;
+			np->n_tim.tv_nsec = info.st_mtim.tv_nsec;
+		}
+#endif
 	} else {
 		np->n_tim.tv_sec = info.st_mtim.tv_sec;
 		np->n_tim.tv_nsec = info.st_mtim.tv_nsec;
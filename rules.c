@@ -27,48 +27,500 @@ suffix(const char *name)
 }
 
 /*
- * Find a name structure whose name is formed by concatenating three
- * strings.  If 'create' is TRUE the name is created if necessary.
+ * Find a name structure whose name is formed by concatenating two
+ * strings.
  */
 static struct name *
-namecat3(const char *s, const char *t, const char *u, int create)
+namecat(const char *s, const char *t)
 {
 	char *p;
 	struct name *np;
 
+	p = xconcat3(s, t, "");
+	np = findname(p);
+	free(p);
+	return np;
+}
+
+// Results of dyndep(), indexed like namev[].  They remain valid until
+// the inference rules change or commands are run, which may create
+// files.
+struct infer {
+	struct name *i_dep;		// Implicit prerequisite or NULL
+	struct cmd *i_cmd;		// Commands of inference rule
+	struct prule *i_prule;	// Pattern rule, if one was used
+	const char *i_stem;		// Stem matched by pattern rule
+	unsigned int i_sgen;	// Value of suffix_gen when found
+	unsigned int i_rgen;	// Value of run_gen when found
+	uint32_t i_edge;		// Prerequisites added to edges[] for
+	uint32_t i_nedge;		// this result, reused by later calls
+	uint8_t i_state;
+};
+
+#define I_NONE	0	// No result
+#define I_BUSY	1	// Search in progress
+#define I_DONE	2	// Result found
+
+static struct infer *infer;
+static uint32_t maxinfer;
+
+// Set if the result of a search depended on targets being made or
+// searches in progress, in which case it isn't remembered.
+static bool uncertain;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// Pattern rules are indexed by a trie of the reversed suffixes of
+// their target patterns.  Following the characters of a name from
+// the end finds the rules whose suffix matches, then their prefixes
+// are checked.
+struct tnode {
+	struct tnode *t_child;		// First node for the preceding character
+	struct tnode *t_sibling;	// Next node at the same position
+	struct prule **t_rule;		// Rules whose suffix ends here
+	int t_nrule;
+	unsigned char t_ch;
+};
+
+struct prule *prules;
+static struct prule **lastprule = &prules;
+static unsigned int nprule;
+static struct tnode ptrie;
+
+/*
+ * Add a pattern rule 'target: prerequisites' where the target and at
+ * least one prerequisite contain '%'.  The last 'norder' prerequisites
+ * are order-only.  A rule with the same target and prerequisites as
+ * an existing one replaces it.  If there are no commands the existing
+ * rule is cancelled.
+ */
+void
+addpattern(const char *target, uint32_t dep, uint32_t ndep, uint32_t norder,
+			struct cmd *cp)
+{
+	struct prule *pr;
+	struct tnode *tp, **tpp;
+	const char *s, *pc;
+	uint32_t i;
+
+	target = intern(target);
+	for (pr = prules; pr; pr = pr->pr_next) {
+		if (pr->pr_target == target && pr->pr_rule.r_ndep == ndep &&
+				pr->pr_rule.r_norder == norder) {
+			for (i = 0; i < ndep; i++) {
+				if (edges[pr->pr_rule.r_dep + i] != edges[dep + i])
+					break;
+			}
+			if (i == ndep) {
+				pr->pr_rule.r_cmd = cp;
+				suffix_gen++;
+				return;
+			}
+		}
+	}
+	if (cp == NULL)
+		return;
+
+	pc = strchr(target, '%');
+	pr = aalloc(sizeof(struct prule));
+	pr->pr_next = NULL;
+	pr->pr_target = target;
+	pr->pr_plen = pc - target;
+	pr->pr_slen = strlen(pc + 1);
+	pr->pr_nodir = strchr(target, '/') == NULL;
+	pr->pr_order = nprule++;
+	pr->pr_rule.r_next = NULL;
+	pr->pr_rule.r_cmd = cp;
+	pr->pr_rule.r_dep = dep;
+	pr->pr_rule.r_ndep = ndep;
+	pr->pr_rule.r_norder = norder;
+	*lastprule = pr;
+	lastprule = &pr->pr_next;
+
+	// Find or create the trie node for the suffix
+	tp = &ptrie;
+	for (s = target + strlen(target); s > pc + 1; ) {
+		--s;
+		for (tpp = &tp->t_child; *tpp; tpp = &(*tpp)->t_sibling) {
+			if ((*tpp)->t_ch == (unsigned char)*s)
+				break;
+		}
+		if (*tpp == NULL) {
+			*tpp = xmalloc(sizeof(struct tnode));
+			memset(*tpp, 0, sizeof(struct tnode));
+			(*tpp)->t_ch = *s;
+		}
+		tp = *tpp;
+	}
+	tp->t_rule = xrealloc(tp->t_rule, (tp->t_nrule + 1) * sizeof(struct prule *));
+	tp->t_rule[tp->t_nrule++] = pr;
+	suffix_gen++;
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+static void
+freepatterns(struct tnode *tp)
+{
+	struct tnode *child, *next;
+
+	for (child = tp->t_child; child; child = next) {
+		next = child->t_sibling;
+		freepatterns(child);
+		free(child);
+	}
+	free(tp->t_rule);
+}
+#endif
+
+static int
+prule_order(const void *a, const void *b)
+{
+	const struct prule *pa = *(struct prule **)a;
+	const struct prule *pb = *(struct prule **)b;
+
+	return pa->pr_order < pb->pr_order ? -1 : pa->pr_order > pb->pr_order;
+}
+
+/*
+ * Find the pattern rules whose target pattern matches a name, in
+ * order of definition.  A pattern without a '/' is matched against
+ * the last component of the name.  Return the number of rules found
+ * and an allocated array of them.
+ */
+static int
+match_patterns(const char *name, struct prule ***list)
+{
+	const char *end = name + strlen(name);
+	const char *base, *s, *p = end;
+	struct tnode *tp = &ptrie;
+	struct prule *pr, **found = NULL;
+	int i, n = 0;
+
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	for (;;) {
+		for (i = 0; i < tp->t_nrule; i++) {
+			pr = tp->t_rule[i];
+			s = pr->pr_nodir ? base : name;
+			// The stem mustn't be empty
+			if (pr->pr_rule.r_cmd && end - s > pr->pr_plen + pr->pr_slen &&
+					strncmp(s, pr->pr_target, pr->pr_plen) == 0) {
+				found = xrealloc(found, (n + 1) * sizeof(struct prule *));
+				found[n++] = pr;
+			}
+		}
+		if (p == name)
+			break;
+		--p;
+		for (tp = tp->t_child; tp; tp = tp->t_sibling) {
+			if (tp->t_ch == (unsigned char)*p)
+				break;
+		}
+		if (tp == NULL)
+			break;
+	}
+	if (n > 1)
+		qsort(found, n, sizeof(struct prule *), prule_order);
+	*list = found;
+	return n;
+}
+
+/*
+ * Return the stem of a name matched by a pattern rule.  If the
+ * target pattern has no '/' the directory of the name is included.
+ */
+static char *
+getstem(const struct prule *pr, const char *name)
+{
+	const char *base = name, *s;
+	size_t dlen, len;
+	char *stem;
+
+	if (pr->pr_nodir && (s = strrchr(name, '/')) != NULL)
+		base = s + 1;
+	dlen = base - name;
+	len = strlen(base) - pr->pr_plen - pr->pr_slen;
+	stem = xmalloc(dlen + len + 1);
+	memcpy(stem, name, dlen);
+	memcpy(stem + dlen, base + pr->pr_plen, len);
+	stem[dlen + len] = '\0';
+	return stem;
+}
+
+/*
+ * Replace the '%' in a prerequisite pattern of a pattern rule with
+ * the stem.  If the target pattern has no '/' and neither does the
+ * prerequisite pattern the directory part of the stem goes first.
+ */
+static char *
+subst_stem(const struct prule *pr, const char *pat, const char *stem)
+{
+	const char *pc = strchr(pat, '%');
+	const char *rest = stem;
+	char *s, *t;
+
+	if (pc == NULL)
+		return xstrdup(pat);
+
+	if (pr->pr_nodir && !strchr(pat, '/') && (s = strrchr(stem, '/')))
+		rest = s + 1;
+	t = s = xmalloc(strlen(pat) + strlen(stem));
+	memcpy(t, stem, rest - stem);
+	t += rest - stem;
+	memcpy(t, pat, pc - pat);
+	t += pc - pat;
+	t = stpcpy(t, rest);
+	strcpy(t, pc + 1);
+	return s;
+}
+#endif
+
+// A candidate implicit prerequisite which isn't in the name table.
+// Most candidates don't exist, so they're only added to the name
+// table if they're selected.  A stand-in has no valid index.
+struct probe {
+	struct name p_name;		// Stand-in, flagged N_PROBE
+	struct infer p_infer;	// Results of dyndep()
+	unsigned int p_tgen;	// Value of run_gen + 1 when time was found
+};
+
+#define NO_INDEX UINT32_MAX
+
+static struct htab probetab;
+
+/*
+ * Make sure the modification time of a name is known.  The time of a
+ * stand-in is found again if commands have been run since then.
+ */
+void
+gettime(struct name *np)
+{
+	struct probe *prp = (struct probe *)np;
+
+	if (!(np->n_flag & N_PROBE)) {
+		if (!np->n_tim.tv_sec)
+			modtime(np);
+	} else if (prp->p_tgen != run_gen + 1) {
+		modtime(np);
+		prp->p_tgen = run_gen + 1;
+	}
+}
+
+/*
+ * Return the name formed by concatenating three strings, or a
+ * stand-in for it if it isn't in the name table.
+ */
+static struct name *
+candidate(const char *s, const char *t, const char *u)
+{
+	char *p;
+	struct name *np;
+	struct probe *prp;
+
 	p = xconcat3(s, t, u);
-	np = create ? newname(p) : findname(p);
+	if ((np = findname(p)) == NULL) {
+		if ((prp = hfind(&probetab, p)) == NULL) {
+			prp = aalloc(sizeof(struct probe));
+			memset(prp, 0, sizeof(struct probe));
+			prp->p_name.n_name = intern(p);
+			prp->p_name.n_flag = N_PROBE;
+			prp->p_name.n_index = NO_INDEX;
+			hinsert(&probetab, prp->p_name.n_name, prp);
+		}
+		np = &prp->p_name;
+	}
 	free(p);
 	return np;
 }
 
+// The inference rules which might apply to targets with a given
+// suffix, in the order of the suffixes in .SUFFIXES.
+struct suffrule {
+	struct name *s_from;	// Suffix of prerequisite
+	struct name *s_rule;	// Inference rule
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	const char *s_prefix;	// Parts of s_from around '%', if any
+	const char *s_suffix;
+#endif
+};
+
+struct sufflist {
+	unsigned int s_gen;		// Value of suffix_gen when list was made
+	int s_count;
+	struct suffrule *s_list;
+};
+
+static struct htab sufftab;
+
 /*
- * Find a name structure whose name is formed by concatenating two
- * strings.  If 'create' is TRUE the name is created if necessary.
+ * Return the list of inference rules for a target suffix, creating
+ * it if it doesn't exist or is out of date.
+ */
+static struct sufflist *
+getsuffrules(const char *suff)
+{
+	struct sufflist *slp = hfind(&sufftab, suff);
+	struct name *xp, *sp;
+	struct suffrule *srp;
+	struct rule *rp;
+	uint32_t i;
+	int max = 0;
+
+	if (slp == NULL) {
+		slp = xmalloc(sizeof(struct sufflist));
+		slp->s_list = NULL;
+		hinsert(&sufftab, intern(suff), slp);
+	} else if (slp->s_gen == suffix_gen) {
+		return slp;
+	}
+
+	slp->s_gen = suffix_gen;
+	slp->s_count = 0;
+	xp = newname(".SUFFIXES");
+	for (rp = xp->n_rule; rp; rp = rp->r_next) {
+		for (i = 0; i < rp->r_ndep; i++) {
+			sp = namecat(getdep(rp, i)->n_name, suff);
+			if (sp && sp->n_rule) {
+				if (slp->s_count == max) {
+					max = MAX(2 * max, 4);
+					slp->s_list = xrealloc(slp->s_list,
+									max * sizeof(struct suffrule));
+				}
+				srp = slp->s_list + slp->s_count++;
+				srp->s_from = getdep(rp, i);
+				srp->s_rule = sp;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				srp->s_prefix = srp->s_suffix = NULL;
+				if (strchr(srp->s_from->n_name, '%')) {
+					char *pattern = xstrdup(srp->s_from->n_name);
+					char *placeholder = strchr(pattern, '%');
+
+					*placeholder = '\0';
+					srp->s_prefix = intern(pattern);
+					srp->s_suffix = intern(placeholder + 1); // May be ""
+					free(pattern);
+				}
+#endif
+			}
+		}
+	}
+	return slp;
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+freesuffrules(void)
+{
+	unsigned int i;
+	struct sufflist *slp;
+
+	for (i = 0; i < sufftab.h_size; i++) {
+		if ((slp = sufftab.h_slot[i].h_data)) {
+			free(slp->s_list);
+			free(slp);
+		}
+	}
+	free(sufftab.h_slot);
+	free(infer);
+	free(probetab.h_slot);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	freepatterns(&ptrie);
+#endif
+}
+#endif
+
+/*
+ * Add a candidate prerequisite to the name table if necessary.
+ */
+static struct name *
+promote(struct name *ip)
+{
+	struct name *np = ip;
+
+	if ((ip->n_flag & N_PROBE)) {
+		np = newname(ip->n_name);
+		gettime(ip);
+		np->n_tim = ip->n_tim;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		np->n_flag |= ip->n_flag & N_VPATH;
+		np->n_path = ip->n_path;
+		// A missing file found by chained inference is intermediate
+		if (!posix && !np->n_tim.tv_sec)
+			np->n_flag |= N_INTERMEDIATE;
+#endif
+	}
+	return np;
+}
+
+/*
+ * Return TRUE if a candidate prerequisite exists or we know how to
+ * make it, possibly using chained inference rules.
+ */
+static int
+usable(struct name *ip, int chain)
+{
+	if (!(ip->n_flag & N_PROBE) && (nstate[ip->n_index] & S_DOING)) {
+		uncertain = TRUE;
+		return FALSE;
+	}
+	gettime(ip);
+	return !chain ? ip->n_tim.tv_sec || (ip->n_flag & N_TARGET) :
+				dyndep(ip, NULL, NULL) != NULL;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Try the pattern rules which match a target.  On success return the
+ * first prerequisite and set the rule and stem.
  */
 static struct name *
-namecat(const char *s, const char *t, int create)
+search_patterns(struct name *np, int chain, struct prule **prp, const char **stemp)
 {
-	return namecat3(s, t, "", create);
+	struct prule **list, *pr;
+	struct name *ip, *pp = NULL;
+	char *stem, *s;
+	uint32_t j;
+	int i, n;
+
+	n = match_patterns(np->n_name, &list);
+	for (i = 0; i < n && !pp; i++) {
+		pr = list[i];
+		stem = getstem(pr, np->n_name);
+		// Order-only prerequisites needn't be usable yet
+		for (j = 0; j < normaldeps(&pr->pr_rule); j++) {
+			s = subst_stem(pr, getdep(&pr->pr_rule, j)->n_name, stem);
+			ip = candidate(s, "", "");
+			free(s);
+			if (!usable(ip, chain))
+				break;
+			if (j == 0)
+				pp = ip;
+		}
+		if (j == normaldeps(&pr->pr_rule)) {
+			*prp = pr;
+			*stemp = intern(stem);
+		} else {
+			pp = NULL;
+		}
+		free(stem);
+	}
+	free(list);
+	return pp;
 }
+#endif
 
 /*
- * Dynamic dependency.  This routine applies the suffix rules
- * to try and find a source and a set of rules for a missing
- * target.  NULL is returned on failure.  On success the name of
- * the implicit prerequisite is returned and the details are
- * placed in the imprule structure provided by the caller.
+ * Apply the pattern and suffix rules to try and find a source and a
+ * set of rules for a missing target.
  */
-struct name *
-dyndep(struct name *np, struct rule *imprule)
+static struct name *
+search(struct name *np, struct cmd **cpp, struct prule **prp,
+		const char **stemp)
 {
-	char *suff, *newsuff;
+	char *suff;
 	char *base, *name, *member;
-	struct name *xp;		// Suffixes
-	struct name *sp;		// Suffix rule
+	struct sufflist *slp;	// Applicable suffix rules
 	struct name *pp = NULL;	// Implicit prerequisite
-	struct rule *rp;
-	struct depend *dp;
+	int i;
 	IF_NOT_FEATURE_MAKE_EXTENSIONS(const) bool chain = FALSE;
 
 	member = NULL;
@@ -78,54 +530,39 @@ dyndep(struct name *np, struct rule *imprule)
 	base = member ? member : name;
 	*suffix(base) = '\0';
 
-	xp = newname(".SUFFIXES");
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
  retry:
+	// Pattern rules take precedence over suffix rules
+	if (!posix && prules) {
+		pp = search_patterns(np, chain, prp, stemp);
+		if (pp) {
+			*cpp = (*prp)->pr_rule.r_cmd;
+			goto finish;
+		}
+	}
 #endif
+	slp = getsuffrules(suff);
+	for (i = 0; i < slp->s_count; i++) {
+		struct suffrule *srp = slp->s_list + i;
+		struct name *ip;
 
-	for (rp = xp->n_rule; rp; rp = rp->r_next) {
-		for (dp = rp->r_dep; dp; dp = dp->d_next) {
-			// Generate new suffix rule to try
-			newsuff = dp->d_name->n_name;
-			sp = namecat(newsuff, suff, FALSE);
-			if (sp && sp->n_rule) {
-				struct name *ip = NULL;
-				// Generate a name for an implicit prerequisite
-				// - apply a path if the suffix is combined with one!
-				if (!strchr(newsuff, '%')) {
-					ip = namecat(base, newsuff, TRUE);
-				} else {
+		// Generate a name for an implicit prerequisite
+		// - apply a path if the suffix is combined with one!
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-DP("%s is a pattern rule!\n", newsuff);
-					char *pattern = xstrdup(newsuff);
-					char *placeholder = strchr(pattern, '%');
-					const char *prefix, *suffix;
-					prefix = pattern;
-					assert(placeholder);
-					*placeholder = '\0';
-					suffix = placeholder + 1; // May just be '\0'
-					ip = namecat3(prefix, base, suffix, TRUE);
-DP("  [prefix: %s] [%%: %s] [suffix: %s] -> %s\n", prefix, base, suffix, ip->n_name);
-					free(pattern);
+		if (srp->s_prefix) {
+DP("%s is a pattern rule!\n", srp->s_from->n_name);
+			ip = candidate(srp->s_prefix, base, srp->s_suffix);
+DP("  [prefix: %s] [%%: %s] [suffix: %s] -> %s\n", srp->s_prefix, base, srp->s_suffix, ip->n_name);
+		} else
 #endif
-				}
+			ip = candidate(base, srp->s_from->n_name, "");
 
-				if ((ip->n_flag & N_DOING))
-					continue;
-				if (!ip->n_tim.tv_sec)
-					modtime(ip);
-				if (!chain ? ip->n_tim.tv_sec || (ip->n_flag & N_TARGET) :
-							dyndep(ip, NULL) != NULL) {
-					// Prerequisite exists or we know how to make it
-					if (imprule) {
-						imprule->r_dep = newdep(ip, NULL);
-						imprule->r_cmd = sp->n_rule->r_cmd;
-					}
-					pp = ip;
+		if (usable(ip, chain)) {
+			// Prerequisite exists or we know how to make it
+			*cpp = srp->s_rule->n_rule->r_cmd;
+			pp = ip;
 DP("OK: %s -> %s\n", pp->n_name, np->n_name);
-					goto finish;
-				}
-			}
+			goto finish;
 		}
 	}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -142,6 +579,117 @@ DP("OK: %s -> %s\n", pp->n_name, np->n_name);
 	return pp;
 }
 
+/*
+ * Dynamic dependency.  This routine applies the pattern and suffix
+ * rules to try and find a source and a set of rules for a missing
+ * target.  NULL is returned on failure.  On success the name of
+ * the implicit prerequisite is returned and the details are
+ * placed in the imprule structure provided by the caller.  If a
+ * pattern rule was used its stem is returned through stemp, else
+ * NULL.
+ *
+ * Results are remembered, both successes and failures, so chained
+ * inference looks at each candidate only once.  A candidate whose
+ * search is already in progress is treated as a failure, which also
+ * stops cycles of inference rules.
+ */
+struct name *
+dyndep(struct name *np, struct rule *imprule, const char **stemp)
+{
+	struct infer *inp;
+	struct name *pp;
+	struct cmd *cp = NULL;
+	struct prule *pr = NULL;
+	const char *stem = NULL;
+	bool saved;
+
+	if ((np->n_flag & N_PROBE)) {
+		inp = &((struct probe *)np)->p_infer;
+	} else {
+		if (maxinfer < nname) {
+			uint32_t max = MAX(nname, 2 * maxinfer);
+
+			infer = xrealloc(infer, max * sizeof(*infer));
+			memset(infer + maxinfer, 0, (max - maxinfer) * sizeof(*infer));
+			maxinfer = max;
+		}
+		inp = infer + np->n_index;
+	}
+	if (inp->i_state == I_DONE && inp->i_sgen == suffix_gen &&
+			inp->i_rgen == run_gen &&
+			!(inp->i_dep && !(inp->i_dep->n_flag & N_PROBE) &&
+				(nstate[inp->i_dep->n_index] & S_DOING))) {
+		pp = inp->i_dep;
+		cp = inp->i_cmd;
+		pr = inp->i_prule;
+		stem = inp->i_stem;
+	} else if (inp->i_state == I_BUSY) {
+		uncertain = TRUE;
+		return NULL;
+	} else {
+		saved = uncertain;
+		uncertain = FALSE;
+		inp->i_state = I_BUSY;
+		pp = search(np, &cp, &pr, &stem);
+
+		// The search may have created names and moved the array
+		if (!(np->n_flag & N_PROBE))
+			inp = infer + np->n_index;
+		inp->i_state = uncertain ? I_NONE : I_DONE;
+		inp->i_dep = pp;
+		inp->i_cmd = cp;
+		inp->i_prule = pr;
+		inp->i_stem = stem;
+		inp->i_sgen = suffix_gen;
+		inp->i_rgen = run_gen;
+		inp->i_nedge = 0;
+		uncertain |= saved;
+	}
+
+	if (pp && imprule && inp->i_nedge) {
+		// The prerequisites are already in edges[]
+		imprule->r_dep = inp->i_edge;
+		imprule->r_ndep = inp->i_nedge;
+		imprule->r_cmd = cp;
+		pp = getdep(imprule, 0);
+	} else if (pp && imprule) {
+		imprule->r_dep = nedge;
+		imprule->r_cmd = cp;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (pr) {
+			// Add all the prerequisites of the pattern rule,
+			// order-only ones last
+			uint32_t i;
+
+			for (i = 0; i < pr->pr_rule.r_ndep; i++) {
+				char *s = subst_stem(pr, getdep(&pr->pr_rule, i)->n_name, stem);
+				struct name *xp = promote(candidate(s, "", ""));
+
+				free(s);
+				if (i == 0)
+					pp = xp;
+				newdep(xp);
+			}
+			imprule->r_ndep = pr->pr_rule.r_ndep;
+		} else
+#endif
+		{
+			pp = promote(pp);
+			newdep(pp);
+			imprule->r_ndep = 1;
+		}
+		inp->i_edge = imprule->r_dep;
+		inp->i_nedge = imprule->r_ndep;
+	}
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (imprule)
+		imprule->r_norder = pr ? pr->pr_rule.r_norder : 0;
+#endif
+	if (stemp)
+		*stemp = stem;
+	return pp;
+}
+
 #define RULES \
 	".SUFFIXES:.o .c .y .l .a .sh .f\n" \
 	".c.o:\n" \
@@ -193,6 +741,29 @@ DP("OK: %s -> %s\n", pp->n_name, np->n_name);
 	"ARFLAGS=-rv\n" \
 	"LDFLAGS=\n"
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Mark the commands of the built-in rules for archive members which
+ * follow compilation:  they add the object file to the archive and
+ * remove it.  Updates made by these commands can be batched.
+ */
+void
+mark_arcmds(void)
+{
+	static const char *arrules[] = {".c.a", ".f.a"};
+	struct name *np;
+	struct cmd *cp;
+	size_t i;
+
+	for (i = 0; i < sizeof(arrules) / sizeof(arrules[0]); i++) {
+		if ((np = findname(arrules[i])) && (cp = getcmd(np))) {
+			while ((cp = cp->c_next))
+				cp->c_archive = TRUE;
+		}
+	}
+}
+#endif
+
 /*
  * Read the built-in rules using a fake fgets-like interface.
  */
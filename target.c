@@ -3,106 +3,72 @@
  */
 #include "make.h"
 
+// Prerequisites of all rules, as indices into namev[]
+uint32_t *edges;
+uint32_t nedge;
+static uint32_t maxedge;
+
 /*
- * Add a prerequisite to the end of the supplied list.
- * Return the new head pointer for that list.
+ * Add a prerequisite to the end of edges[].  The prerequisites of a
+ * rule are those added since the count of edges was last noted.
  */
-struct depend *
-newdep(struct name *np, struct depend *dphead)
-{
-	struct depend *dpnew;
-	struct depend *dp;
-
-	dpnew = xmalloc(sizeof(struct depend));
-	dpnew->d_next = NULL;
-	dpnew->d_name = np;
-	dpnew->d_refcnt = 0;
-
-	if (dphead == NULL)
-		return dpnew;
-
-	for (dp = dphead; dp->d_next; dp = dp->d_next)
-		;
-
-	dp->d_next = dpnew;
-
-	return dphead;
-}
-
 void
-freedeps(struct depend *dp)
+newdep(struct name *np)
 {
-	struct depend *nextdp;
-
-	if (dp && --dp->d_refcnt <= 0) {
-		for (; dp; dp = nextdp) {
-			nextdp = dp->d_next;
-			free(dp);
-		}
+	if (nedge == maxedge) {
+		maxedge = MAX(2 * maxedge, 1024);
+		edges = xrealloc(edges, maxedge * sizeof(*edges));
 	}
+	edges[nedge++] = np->n_index;
 }
 
 /*
- * Add a command to the end of the supplied list of commands.
- * Return the new head pointer for that list.
+ * Add a command to the end of a list of commands.  The argument points
+ * to the terminating link of the list.  Return a pointer to the new one.
  */
-struct cmd *
-newcmd(char *str, struct cmd *cphead)
+struct cmd **
+newcmd(char *str, struct cmd **cpp)
 {
 	struct cmd *cpnew;
-	struct cmd *cp;
 
 	while (isspace(*str))
 		str++;
 
-	if (*str == '\0')		// No command, return current head
-		return cphead;
+	if (*str == '\0')		// No command, list is unchanged
+		return cpp;
 
-	cpnew = xmalloc(sizeof(struct cmd));
+	cpnew = aalloc(sizeof(struct cmd));
 	cpnew->c_next = NULL;
-	cpnew->c_cmd = xstrdup(str);
-	cpnew->c_refcnt = 0;
-	cpnew->c_makefile = makefile;
+	cpnew->c_cmd = intern(str);
+	cpnew->c_makefile = makefile ? intern(makefile) : NULL;
 	cpnew->c_dispno = dispno;
+	cpnew->c_tmpl = NULL;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	cpnew->c_batch = FALSE;
+	cpnew->c_archive = FALSE;
+	cpnew->c_ngroup = 0;
+#endif
 
-	if (cphead == NULL)
-		return cpnew;
-
-	for (cp = cphead; cp->c_next; cp = cp->c_next)
-		;
-
-	cp->c_next = cpnew;
-
-	return cphead;
+	*cpp = cpnew;
+	return &cpnew->c_next;
 }
 
-void
-freecmds(struct cmd *cp)
-{
-	struct cmd *nextcp;
+struct htab nametab;
+struct name *firstname;
 
-	if (cp && --cp->c_refcnt <= 0) {
-		for (; cp; cp = nextcp) {
-			nextcp = cp->c_next;
-			free(cp->c_cmd);
-			free(cp);
-		}
-	}
-}
+// Incremented whenever the rules of a special target change
+unsigned int suffix_gen;
 
-struct name *namehead[HTABSIZE];
-struct name *firstname;
+// All names, in order of creation, and their traversal state
+struct name **namev;
+uint8_t *nstate;
+uint32_t nname;
+static uint32_t maxname;
 
 struct name *
 findname(const char *name)
 {
-	struct name *np;
-
-	for (np = namehead[getbucket(name)]; np; np = np->n_next) {
-		if (strcmp(name, np->n_name) == 0)
-			return np;
-	}
-	return NULL;
+	return hfind(&nametab, name);
 }
 
 static int
@@ -169,8 +135,6 @@ newname(const char *name)
 	struct name *np = findname(name);
 
 	if (np == NULL) {
-		unsigned int bucket;
-
 		if (!is_valid_target(name))
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 			error("invalid target name '%s'%s", name,
@@ -180,14 +144,24 @@ newname(const char *name)
 			error("invalid target name '%s'", name);
 #endif
 
-		bucket = getbucket(name);
-		np = xmalloc(sizeof(struct name));
-		np->n_next = namehead[bucket];
-		namehead[bucket] = np;
-		np->n_name = xstrdup(name);
+		np = aalloc(sizeof(struct name));
+		np->n_name = intern(name);
 		np->n_rule = NULL;
+		np->n_lastrule = NULL;
 		np->n_tim = (struct timespec){0, 0};
 		np->n_flag = 0;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		np->n_path = NULL;
+#endif
+		if (nname == maxname) {
+			maxname = MAX(2 * maxname, 256);
+			namev = xrealloc(namev, maxname * sizeof(*namev));
+			nstate = xrealloc(nstate, maxname);
+		}
+		np->n_index = nname;
+		namev[nname] = np;
+		nstate[nname++] = 0;
+		hinsert(&nametab, np->n_name, np);
 	}
 	return np;
 }
@@ -213,45 +187,15 @@ getcmd(struct name *np)
 void
 freenames(void)
 {
-	int i;
-	struct name *np, *nextnp;
-
-	for (i = 0; i < HTABSIZE; i++) {
-		for (np = namehead[i]; np; np = nextnp) {
-			nextnp = np->n_next;
-			free(np->n_name);
-			freerules(np->n_rule);
-			free(np);
-		}
-	}
+	// Names, rules and their contents are all in the arena
+	free(nametab.h_slot);
+	free(namev);
+	free(nstate);
+	free(edges);
+	freearena();
 }
 #endif
 
-void
-freerules(struct rule *rp)
-{
-	struct rule *nextrp;
-
-	for (; rp; rp = nextrp) {
-		nextrp = rp->r_next;
-		freedeps(rp->r_dep);
-		freecmds(rp->r_cmd);
-		free(rp);
-	}
-}
-
-static void *
-inc_ref(void *vp)
-{
-	if (vp) {
-		struct depend *dp = vp;
-		if (dp->d_refcnt == INT_MAX)
-			error("out of memory");
-		dp->d_refcnt++;
-	}
-	return vp;
-}
-
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 void
 set_pragma(const char *name)
@@ -276,6 +220,22 @@ set_pragma(const char *name)
 }
 #endif
 
+/*
+ * Set or clear the flag which marks the prerequisites of .SUFFIXES
+ * in a list of its rules, so looking up a suffix doesn't need to
+ * search them.
+ */
+static void
+marksuffixes(struct rule *rp, uint16_t flag)
+{
+	uint32_t i;
+
+	for (; rp; rp = rp->r_next) {
+		for (i = 0; i < rp->r_ndep; i++)
+			getdep(rp, i)->n_flag = (getdep(rp, i)->n_flag & ~N_SUFFIX) | flag;
+	}
+}
+
 /*
  * Add a new rule to a target.  This checks to see if commands already
  * exist for the target.  If flag is TRUE the target can have multiple
@@ -288,10 +248,9 @@ set_pragma(const char *name)
  *     This is for redefining commands for an inference rule.
  */
 void
-addrule(struct name *np, struct depend *dp, struct cmd *cp, int flag)
+addrule(struct name *np, uint32_t dep, uint32_t ndep, struct cmd *cp, int flag)
 {
 	struct rule *rp;
-	struct rule **rpp;
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	// Can't mix single-colon and double-colon rules
@@ -301,8 +260,11 @@ addrule(struct name *np, struct depend *dp, struct cmd *cp, int flag)
 	}
 #endif
 
+	if ((np->n_flag & N_SPECIAL))
+		suffix_gen++;
+
 	// Clear out prerequisites and commands
-	if ((np->n_flag & N_SPECIAL) && !dp && !cp) {
+	if ((np->n_flag & N_SPECIAL) && !ndep && !cp) {
 #if ENABLE_FEATURE_MAKE_POSIX_202X
 		if (strcmp(np->n_name, ".PHONY") == 0)
 			return;
@@ -311,37 +273,47 @@ addrule(struct name *np, struct depend *dp, struct cmd *cp, int flag)
 		if (strcmp(np->n_name, ".PRAGMA") == 0)
 			pragma = 0;
 #endif
-		freerules(np->n_rule);
-		np->n_rule = NULL;
+		if (strcmp(np->n_name, ".SUFFIXES") == 0)
+			marksuffixes(np->n_rule, 0);
+		np->n_rule = np->n_lastrule = NULL;
 		return;
 	}
 
 	if (cp && !(np->n_flag & N_DOUBLE) && getcmd(np)) {
 		// Handle the inference rule redefinition case
-		if ((np->n_flag & N_SPECIAL) && !dp) {
-			freerules(np->n_rule);
-			np->n_rule = NULL;
+		if ((np->n_flag & N_SPECIAL) && !ndep) {
+			np->n_rule = np->n_lastrule = NULL;
 		} else {
 			error("commands defined twice for target %s", np->n_name);
 		}
 	}
 
-	rpp = &np->n_rule;
-	while (*rpp)
-		rpp = &(*rpp)->r_next;
-
-	*rpp = rp = xmalloc(sizeof(struct rule));
+	rp = aalloc(sizeof(struct rule));
 	rp->r_next = NULL;
-	rp->r_dep = inc_ref(dp);
-	rp->r_cmd = inc_ref(cp);
+	rp->r_cmd = cp;
+	rp->r_dep = dep;
+	rp->r_ndep = ndep;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	rp->r_norder = 0;
+#endif
+	if (np->n_lastrule)
+		np->n_lastrule->r_next = rp;
+	else
+		np->n_rule = rp;
+	np->n_lastrule = rp;
+
+	if ((np->n_flag & N_SPECIAL) && strcmp(np->n_name, ".SUFFIXES") == 0)
+		marksuffixes(rp, N_SUFFIX);
 
 	np->n_flag |= N_TARGET;
 	if (flag)
 		np->n_flag |= N_DOUBLE;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	if (strcmp(np->n_name, ".PRAGMA") == 0) {
-		for (; dp; dp = dp->d_next) {
-			set_pragma(dp->d_name->n_name);
+		uint32_t i;
+
+		for (i = 0; i < ndep; i++) {
+			set_pragma(getdep(rp, i)->n_name);
 		}
 	}
 #endif
@@ -0,0 +1,189 @@
+/*
+ * Library preloaded into commands run by make for targets marked
+ * .TRACEDEPS.  Files opened successfully are reported to make on the
+ * file descriptor named by MAKE_TRACEFD, one per line as 'r' or 'w'
+ * followed by an absolute path.
+ *
+ * This relies on the dynamic linker supporting LD_PRELOAD and
+ * RTLD_NEXT, as on Linux with glibc or musl.  Statically linked
+ * programs aren't traced.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef O_DIRECTORY
+# define O_DIRECTORY 0
+#endif
+
+static int tracefd = -2;
+
+/*
+ * Find the real version of a function.
+ */
+static void *
+real(const char *name)
+{
+	return dlsym(RTLD_NEXT, name);
+}
+
+/*
+ * Report a file which has been opened.  Relative paths are taken
+ * relative to the current directory or, for the *at() functions, the
+ * directory open on dirfd.
+ */
+static void
+report(int dirfd, const char *path, int flags)
+{
+	char buf[2 * PATH_MAX + 4], link[64];
+	size_t len;
+	ssize_t n;
+	int olderr = errno;
+
+	if (tracefd == -2) {
+		const char *s = getenv("MAKE_TRACEFD");
+
+		tracefd = s ? atoi(s) : -1;
+	}
+	if (tracefd < 0 || path == NULL || (flags & O_DIRECTORY))
+		goto done;
+
+	buf[0] = (flags & O_ACCMODE) == O_RDONLY ? 'r' : 'w';
+	buf[1] = ' ';
+	if (*path == '/') {
+		len = 2;
+	} else {
+		if (dirfd == AT_FDCWD) {
+			if (getcwd(buf + 2, PATH_MAX) == NULL)
+				goto done;
+		} else {
+			snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+			if ((n = readlink(link, buf + 2, PATH_MAX)) <= 0)
+				goto done;
+			buf[2 + n] = '\0';
+		}
+		len = strlen(buf);
+		buf[len++] = '/';
+		if (path[0] == '.' && path[1] == '/')
+			path += 2;
+	}
+	if (len + strlen(path) + 2 > sizeof(buf))
+		goto done;
+	len += sprintf(buf + len, "%s\n", path);
+	// Lines are short enough to be written atomically to a pipe
+	n = write(tracefd, buf, len);
+ done:
+	errno = olderr;
+}
+
+/*
+ * Convert a stdio mode to open(2) flags.
+ */
+static int
+modeflags(const char *mode)
+{
+	return mode[0] == 'r' && !strchr(mode, '+') ? O_RDONLY : O_RDWR;
+}
+
+// Wrappers for functions taking an optional mode
+#define OPENFN(name, args, callargs, dirfd, path, flags) \
+int \
+name args \
+{ \
+	static __typeof__(name) *fn; \
+	mode_t mode = 0; \
+	int fd; \
+\
+	if (fn == NULL) \
+		fn = real(#name); \
+	if ((flags & O_CREAT) || HAS_TMPFILE(flags)) { \
+		va_list va; \
+		va_start(va, flags); \
+		mode = va_arg(va, mode_t); \
+		va_end(va); \
+	} \
+	fd = fn callargs; \
+	if (fd >= 0) \
+		report(dirfd, path, flags); \
+	return fd; \
+}
+
+// O_TMPFILE includes the bits of O_DIRECTORY, so all must be set
+#ifdef O_TMPFILE
+# define HAS_TMPFILE(flags) (((flags) & O_TMPFILE) == O_TMPFILE)
+#else
+# define HAS_TMPFILE(flags) 0
+#endif
+
+OPENFN(open, (const char *path, int flags, ...),
+		(path, flags, mode), AT_FDCWD, path, flags)
+OPENFN(open64, (const char *path, int flags, ...),
+		(path, flags, mode), AT_FDCWD, path, flags)
+OPENFN(openat, (int dirfd, const char *path, int flags, ...),
+		(dirfd, path, flags, mode), dirfd, path, flags)
+OPENFN(openat64, (int dirfd, const char *path, int flags, ...),
+		(dirfd, path, flags, mode), dirfd, path, flags)
+
+// Fortified versions used when compiled with _FORTIFY_SOURCE
+int
+__open_2(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+int
+__open64_2(const char *path, int flags)
+{
+	return open64(path, flags);
+}
+
+int
+__openat_2(int dirfd, const char *path, int flags)
+{
+	return openat(dirfd, path, flags);
+}
+
+int
+__openat64_2(int dirfd, const char *path, int flags)
+{
+	return openat64(dirfd, path, flags);
+}
+
+int
+creat(const char *path, mode_t mode)
+{
+	return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int
+creat64(const char *path, mode_t mode)
+{
+	return open64(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+// The C library's stdio doesn't call the wrappers above
+#define FOPENFN(name) \
+FILE * \
+name(const char *path, const char *mode) \
+{ \
+	static __typeof__(name) *fn; \
+	FILE *fp; \
+\
+	if (fn == NULL) \
+		fn = real(#name); \
+	if ((fp = fn(path, mode)) != NULL) \
+		report(AT_FDCWD, path, modeflags(mode)); \
+	return fp; \
+}
+
+FOPENFN(fopen)
+FOPENFN(fopen64)
@@ -124,40 +124,189 @@ xappendword(const char *str, const char *word)
 	return newstr;
 }
 
-unsigned int
-getbucket(const char *name)
+/*
+ * Append len characters to a buffer, growing it as required.
+ */
+void
+bufadd(struct buffer *bp, const char *s, size_t len)
+{
+	if (bp->b_len + len >= bp->b_size) {
+		bp->b_size = MAX(2 * bp->b_size, bp->b_len + len + 64);
+		bp->b_str = xrealloc(bp->b_str, bp->b_size);
+	}
+	memcpy(bp->b_str + bp->b_len, s, len);
+	bp->b_len += len;
+	bp->b_str[bp->b_len] = '\0';
+}
+
+/*
+ * FNV-1a hash of a string.
+ */
+uint32_t
+strhash(const char *s)
 {
-	unsigned int hashval = 0;
-	const unsigned char *p = (unsigned char *)name;
+	uint32_t hash = 2166136261U;
 
-	while (*p)
-		hashval ^= (hashval << 5) + (hashval >> 2) + *p++;
-	return hashval % HTABSIZE;
+	while (*s) {
+		hash ^= (unsigned char)*s++;
+		hash *= 16777619U;
+	}
+	return hash;
 }
 
 /*
- * Add a file to the end of the supplied list of files.
- * Return the new head pointer for that list.
+ * Return the data stored in a hash table with the given key, or NULL.
+ * The full hash is compared before the keys.
  */
-struct file *
-newfile(char *str, struct file *fphead)
+void *
+hfind(const struct htab *tp, const char *key)
 {
-	struct file *fpnew;
-	struct file *fp;
+	uint32_t hash;
+	unsigned int i, mask = tp->h_size - 1;
+	struct hslot *sp;
 
-	fpnew = xmalloc(sizeof(struct cmd));
-	fpnew->f_next = NULL;
-	fpnew->f_name = xstrdup(str);
+	if (tp->h_size == 0)
+		return NULL;
 
-	if (fphead == NULL)
-		return fpnew;
+	hash = strhash(key);
+	for (i = hash & mask; (sp = tp->h_slot + i)->h_data; i = (i + 1) & mask) {
+		if (sp->h_key == key ||
+				(sp->h_hash == hash && strcmp(sp->h_key, key) == 0))
+			return sp->h_data;
+	}
+	return NULL;
+}
 
-	for (fp = fphead; fp->f_next; fp = fp->f_next)
+/*
+ * Store data in a free slot of an array of slots.
+ */
+static void
+hplace(struct hslot *slot, unsigned int size, uint32_t hash,
+		const char *key, void *data)
+{
+	unsigned int i, mask = size - 1;
+
+	for (i = hash & mask; slot[i].h_data; i = (i + 1) & mask)
 		;
+	slot[i].h_hash = hash;
+	slot[i].h_key = key;
+	slot[i].h_data = data;
+}
+
+/*
+ * Add data with a key that isn't already present to a hash table.
+ * The table is doubled in size if it would be more than half full.
+ */
+void
+hinsert(struct htab *tp, const char *key, void *data)
+{
+	if (2 * (tp->h_count + 1) > tp->h_size) {
+		unsigned int i, size = tp->h_size ? 2 * tp->h_size : 64;
+		struct hslot *slot = xmalloc(size * sizeof(struct hslot));
+
+		memset(slot, 0, size * sizeof(struct hslot));
+		for (i = 0; i < tp->h_size; i++) {
+			if (tp->h_slot[i].h_data)
+				hplace(slot, size, tp->h_slot[i].h_hash,
+						tp->h_slot[i].h_key, tp->h_slot[i].h_data);
+		}
+		free(tp->h_slot);
+		tp->h_slot = slot;
+		tp->h_size = size;
+	}
+	hplace(tp->h_slot, tp->h_size, strhash(key), key, data);
+	tp->h_count++;
+}
+
+/*
+ * Objects which last as long as the makefile are allocated from large
+ * chunks of memory that are never freed individually.
+ */
+#define ACHUNK 65536
 
-	fp->f_next = fpnew;
+union aalign {
+	void *a_ptr;
+	long long a_int;
+	double a_dbl;
+};
+
+struct achunk {
+	struct achunk *a_next;
+	union aalign a_mem[];
+};
+
+static struct achunk *arena;
+static char *anext;		// Next free byte in current chunk
+static size_t aleft;	// Number of free bytes in current chunk
+
+void *
+aalloc(size_t len)
+{
+	void *p;
+
+	len = (len + sizeof(union aalign) - 1) & ~(sizeof(union aalign) - 1);
+	if (len > aleft) {
+		size_t size = len > ACHUNK ? len : ACHUNK;
+		struct achunk *ap = xmalloc(sizeof(struct achunk) + size);
+
+		ap->a_next = arena;
+		arena = ap;
+		anext = (char *)ap->a_mem;
+		aleft = size;
+	}
+	p = anext;
+	anext += len;
+	aleft -= len;
+	return p;
+}
+
+static struct htab strtab;
+
+/*
+ * Return a pointer to the single stored copy of a string.  Interned
+ * strings are never freed.
+ */
+const char *
+intern(const char *s)
+{
+	char *p = hfind(&strtab, s);
+
+	if (p == NULL) {
+		p = strcpy(aalloc(strlen(s) + 1), s);
+		hinsert(&strtab, p, p);
+	}
+	return p;
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+freearena(void)
+{
+	struct achunk *ap, *nextap;
+
+	for (ap = arena; ap; ap = nextap) {
+		nextap = ap->a_next;
+		free(ap);
+	}
+	free(strtab.h_slot);
+}
+#endif
+
+/*
+ * Add a file to the end of a list of files.  The argument points to
+ * the terminating link of the list.  Return a pointer to the new one.
+ */
+struct file **
+newfile(char *str, struct file **fpp)
+{
+	struct file *fpnew;
+
+	fpnew = xmalloc(sizeof(struct file));
+	fpnew->f_next = NULL;
+	fpnew->f_name = xstrdup(str);
 
-	return fphead;
+	*fpp = fpnew;
+	return &fpnew->f_next;
 }
 
 #if ENABLE_FEATURE_CLEAN_UP